@@ -2,10 +2,14 @@
 // 
 // Uses libzip, alternatives are minizip (from zlib) and zziplib.
 
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "archive.h"
+#include "str.h"
 
 #ifndef ZIP_RDONLY
 typedef struct zip zip_t;
@@ -16,47 +20,168 @@ typedef struct zip_file zip_file_t;
 
 void print_zip_err(char *prefix, zip_t *zip);
 
+// Archives are kept open for the life of the process, with a hash table of
+// their entry names, so that the central directory of each is only parsed
+// once, however many lookups are made. libzip archives aren't safe to use
+// from multiple threads, so all access is under a lock.
+
+struct zip_name_slot {
+    const char *name;
+    zip_uint64_t index;
+};
+
+struct open_zip {
+    char *path;
+    zip_t *archive;
+    struct zip_name_slot *names;
+    size_t capacity;
+};
+
+static pthread_mutex_t zips_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct open_zip *zips = NULL;
+static size_t num_zips = 0;
+
+static struct zip_name_slot *zip_name_slot(struct open_zip *zip, const char *name) {
+    size_t mask = zip->capacity - 1;
+    size_t i = str_hash(name) & mask;
+    while (zip->names[i].name != NULL && strcmp(zip->names[i].name, name) != 0) {
+        i = (i + 1) & mask;
+    }
+    return &zip->names[i];
+}
+
+static void index_zip(struct open_zip *zip) {
+    zip_int64_t num_entries = zip_get_num_entries(zip->archive, 0);
+
+    // Keep the load factor under 1/2
+    zip->capacity = 16;
+    while (zip->capacity < 2 * (size_t) num_entries) {
+        zip->capacity *= 2;
+    }
+    zip->names = calloc(zip->capacity, sizeof(struct zip_name_slot));
+
+    for (zip_int64_t i = 0; i < num_entries; i++) {
+        const char *name = zip_get_name(zip->archive, (zip_uint64_t) i, 0);
+        if (name != NULL) {
+            struct zip_name_slot *slot = zip_name_slot(zip, name);
+            if (slot->name == NULL) {
+                slot->name = name;
+                slot->index = (zip_uint64_t) i;
+            }
+        }
+    }
+}
+
+// Returns the open archive at path, opening it if need be. The archive of
+// the result is NULL if the file couldn't be opened. Called with zips_lock
+// held.
+static struct open_zip *open_zip(char *path) {
+    for (size_t i = 0; i < num_zips; i++) {
+        if (strcmp(zips[i].path, path) == 0) {
+            return &zips[i];
+        }
+    }
+
+    zips = realloc(zips, (num_zips + 1) * sizeof(struct open_zip));
+    struct open_zip *zip = &zips[num_zips++];
+    zip->path = strdup(path);
+    zip->names = NULL;
+    zip->capacity = 0;
+    zip->archive = zip_open(path, ZIP_RDONLY, NULL);
+    if (zip->archive == NULL) {
+        print_zip_err("zip_open", zip->archive);
+    } else {
+        index_zip(zip);
+    }
+
+    return zip;
+}
+
+static bool locate_zip_entry(struct open_zip *zip, char *name, zip_uint64_t *index) {
+    if (zip->archive == NULL) {
+        return false;
+    }
+
+    struct zip_name_slot *slot = zip_name_slot(zip, name);
+    if (slot->name == NULL) {
+        return false;
+    }
+
+    *index = slot->index;
+    return true;
+}
+
 char *get_contents_zip(char *path, char *name, time_t *last_modified) {
-    zip_t *archive = zip_open(path, ZIP_RDONLY, NULL);
-    if (archive == NULL) {
-        print_zip_err("zip_open", archive);
-        return NULL;
+    char *buf = NULL;
+
+    pthread_mutex_lock(&zips_lock);
+
+    struct open_zip *zip = open_zip(path);
+    zip_uint64_t index;
+    if (!locate_zip_entry(zip, name, &index)) {
+        goto unlock;
     }
 
     zip_stat_t stat;
-    if (zip_stat(archive, name, 0, &stat) < 0) {
-        goto close_archive;
+    if (zip_stat_index(zip->archive, index, 0, &stat) < 0) {
+        goto unlock;
     }
 
-    zip_file_t *f = zip_fopen(archive, name, 0);
+    zip_file_t *f = zip_fopen_index(zip->archive, index, 0);
     if (f == NULL) {
-        print_zip_err("zip_fopen", archive);
-        goto close_archive;
+        print_zip_err("zip_fopen", zip->archive);
+        goto unlock;
     }
 
     if (last_modified != NULL) {
         *last_modified = stat.mtime;
     }
 
-    char *buf = malloc(stat.size + 1);
+    buf = malloc(stat.size + 1);
     if (zip_fread(f, buf, stat.size) < 0) {
-        print_zip_err("zip_fread", archive);
-        goto free_buf;
+        print_zip_err("zip_fread", zip->archive);
+        free(buf);
+        buf = NULL;
+    } else {
+        buf[stat.size] = '\0';
     }
-    buf[stat.size] = '\0';
 
     zip_fclose(f);
-    zip_close(archive);
+
+    unlock:
+    pthread_mutex_unlock(&zips_lock);
 
     return buf;
+}
 
-    free_buf:
-    free(buf);
-    zip_fclose(f);
-    close_archive:
-    zip_close(archive);
+void for_each_entry_zip(char *path, void (*f)(const char *name, void *data), void *data) {
+    pthread_mutex_lock(&zips_lock);
+
+    struct open_zip *zip = open_zip(path);
+    for (size_t i = 0; i < zip->capacity; i++) {
+        if (zip->names[i].name != NULL) {
+            f(zip->names[i].name, data);
+        }
+    }
+
+    pthread_mutex_unlock(&zips_lock);
+}
+
+void close_zips() {
+    pthread_mutex_lock(&zips_lock);
+
+    for (size_t i = 0; i < num_zips; i++) {
+        if (zips[i].archive != NULL) {
+            zip_discard(zips[i].archive);
+        }
+        free(zips[i].names);
+        free(zips[i].path);
+    }
+    free(zips);
+    zips = NULL;
+    num_zips = 0;
 
-    return NULL;
+    pthread_mutex_unlock(&zips_lock);
 }
 
 void print_zip_err(char *prefix, zip_t *zip) {
@@ -1,3 +1,10 @@
 #include <zip.h>
 
 char *get_contents_zip(char *path, char *name, time_t *last_modified);
+
+// Calls f with the name of each entry of the archive at path
+void for_each_entry_zip(char *path, void (*f)(const char *name, void *data), void *data);
+
+// Closes the archives kept open by the above, so that they are reopened
+// (and any changes to them seen) on next use
+void close_zips();
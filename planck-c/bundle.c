@@ -1,15 +1,563 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#include "bundle_format.h"
 #include "bundle_inflate.h"
 
-char *bundle_get_contents(char *path) {
-    fprintf(stderr, "WARN: no bundled sources, need to run script/bundle-c\n");
+// The archive built by script/bundle-c, embedded by bundle_data.c
+extern const unsigned char bundle_data_start[];
+extern const unsigned char bundle_data_end[];
+
+static const unsigned char *bundle_data = NULL;
+static const struct bundle_header *bundle_header = NULL;
+static const struct bundle_index_entry *bundle_index = NULL;
+
+static pthread_once_t bundle_once = PTHREAD_ONCE_INIT;
+
+// An LRU cache of inflated entries, so that repeated lookups of the same
+// path (goog/deps.js, planck/bundle.js, ...) only inflate once. Callers
+// are handed copies, as they own (and free) what bundle_get_contents
+// returns. The cap, in bytes, can be set with PLANCK_BUNDLE_CACHE_SIZE.
+
+#define BUNDLE_CACHE_DEFAULT_SIZE (8 * 1024 * 1024)
+
+struct bundle_cache_node {
+    uint32_t index;
+    char *contents;
+    size_t len;
+    struct bundle_cache_node *prev;
+    struct bundle_cache_node *next;
+};
+
+static pthread_mutex_t bundle_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bundle_cache_node **bundle_cache_nodes = NULL;
+static struct bundle_cache_node *bundle_cache_head = NULL;
+static struct bundle_cache_node *bundle_cache_tail = NULL;
+static size_t bundle_cache_size = 0;
+static size_t bundle_cache_max_size = BUNDLE_CACHE_DEFAULT_SIZE;
+static unsigned long bundle_cache_hits = 0;
+static unsigned long bundle_cache_misses = 0;
+
+// Startup loads the same entries in the same order on every run, so the
+// archive carries that order, recorded at build time. While the engine
+// evaluates one entry, a helper thread inflates (into the cache above) the
+// next few the load order says are coming, until startup completes.
+// Setting PLANCK_BUNDLE_RECORD_LOAD_ORDER to a path records the order.
+
+#define BUNDLE_PREFETCH_AHEAD 8
+#define BUNDLE_NONE UINT32_MAX
+
+static pthread_cond_t bundle_prefetch_cond = PTHREAD_COND_INITIALIZER;
+static const uint32_t *bundle_load_order = NULL;
+static uint32_t *bundle_load_order_pos = NULL;
+static uint32_t bundle_prefetch_next = 0;
+static uint32_t bundle_prefetch_consumed = 0;
+static uint32_t bundle_prefetch_in_flight = BUNDLE_NONE;
+static bool bundle_prefetch_stopped = false;
+
+// The inflated pre-linked boot script, kept until startup completes
+static pthread_mutex_t bundle_boot_lock = PTHREAD_MUTEX_INITIALIZER;
+static const struct bundle_boot_file *bundle_boot_files = NULL;
+static char *bundle_boot_data = NULL;
+static bool bundle_boot_inflated = false;
+
+static pthread_mutex_t bundle_record_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *bundle_record_file = NULL;
+static char *bundle_recorded = NULL;
+
+// Maps the archive named by PLANCK_BUNDLE, if set, so that the bundle
+// can be swapped without relinking.
+static const unsigned char *bundle_map_sidecar(size_t *size) {
+    char *path = getenv("PLANCK_BUNDLE");
+    if (path == NULL || path[0] == '\0') {
+        return NULL;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+
+    struct stat fd_stat;
+    if (fstat(fd, &fd_stat) < 0 || fd_stat.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void *addr = mmap(NULL, (size_t) fd_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        perror(path);
+        return NULL;
+    }
+
+    *size = (size_t) fd_stat.st_size;
+    return addr;
+}
+
+static int bundle_valid(const unsigned char *data, size_t size) {
+    if (size < sizeof(struct bundle_header)) {
+        return 0;
+    }
+
+    const struct bundle_header *header = (const struct bundle_header *) data;
+    if (memcmp(header->magic, BUNDLE_MAGIC, BUNDLE_MAGIC_LEN) != 0 || header->version != BUNDLE_VERSION) {
+        return 0;
+    }
+
+    size_t index_end = header->index_offset + (size_t) header->num_entries * sizeof(struct bundle_index_entry);
+    return header->size <= size
+           && index_end <= header->paths_offset
+           && header->paths_offset <= header->dict_offset
+           && header->dict_offset + (size_t) header->dict_len <= header->load_order_offset
+           && header->load_order_offset + (size_t) header->num_load_order * sizeof(uint32_t)
+              <= header->boot_files_offset
+           && header->boot_files_offset + (size_t) header->num_boot_files * sizeof(struct bundle_boot_file)
+              <= header->closure_index_offset
+           && header->closure_index_offset
+              + (size_t) header->num_closure_provides * sizeof(struct bundle_closure_provide) <= header->data_offset
+           && header->data_offset <= header->boot_data_offset
+           && header->boot_data_offset + (size_t) header->boot_gz_len <= header->size;
+}
+
+static void *bundle_prefetch(void *data);
+
+static void bundle_start_prefetch(void) {
+    if (bundle_header->num_load_order == 0 || bundle_cache_max_size == 0) {
+        return;
+    }
+
+    bundle_load_order = (const uint32_t *) (bundle_data + bundle_header->load_order_offset);
+    bundle_load_order_pos = calloc(bundle_header->num_entries, sizeof(uint32_t));
+    for (uint32_t i = 0; i < bundle_header->num_load_order; i++) {
+        if (bundle_load_order[i] < bundle_header->num_entries) {
+            bundle_load_order_pos[bundle_load_order[i]] = i + 1;
+        }
+    }
+
+    pthread_t prefetch_thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&prefetch_thread, &attr, bundle_prefetch, NULL) != 0) {
+        bundle_prefetch_stopped = true;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+static void bundle_open(void) {
+    size_t size = 0;
+    const unsigned char *data = bundle_map_sidecar(&size);
+    if (data == NULL) {
+        data = bundle_data_start;
+        size = (size_t) (bundle_data_end - bundle_data_start);
+    }
+
+    if (size == 0) {
+        fprintf(stderr, "WARN: no bundled sources, need to run script/bundle-c\n");
+        return;
+    }
+
+    if (!bundle_valid(data, size)) {
+        fprintf(stderr, "WARN: bundled sources are corrupt or stale, need to run script/bundle-c\n");
+        return;
+    }
+
+    bundle_data = data;
+    bundle_header = (const struct bundle_header *) data;
+    bundle_index = (const struct bundle_index_entry *) (data + bundle_header->index_offset);
+
+    char *cache_size = getenv("PLANCK_BUNDLE_CACHE_SIZE");
+    if (cache_size != NULL) {
+        bundle_cache_max_size = (size_t) strtoull(cache_size, NULL, 10);
+    }
+    bundle_cache_nodes = calloc(bundle_header->num_entries, sizeof(struct bundle_cache_node *));
+
+    char *record_path = getenv("PLANCK_BUNDLE_RECORD_LOAD_ORDER");
+    if (record_path != NULL && record_path[0] != '\0') {
+        bundle_record_file = fopen(record_path, "w");
+        if (bundle_record_file == NULL) {
+            perror(record_path);
+        }
+        bundle_recorded = calloc(bundle_header->num_entries, 1);
+    } else {
+        bundle_start_prefetch();
+    }
+}
+
+static int bundle_entry_compare(const void *key, const void *entry) {
+    return strcmp(key, (const char *) bundle_data + ((const struct bundle_index_entry *) entry)->path_offset);
+}
+
+static const struct bundle_index_entry *bundle_lookup(char *path) {
+    pthread_once(&bundle_once, bundle_open);
+
+    if (path == NULL || bundle_data == NULL) {
+        return NULL;
+    }
+
+    const struct bundle_index_entry *entry = bsearch(path, bundle_index, bundle_header->num_entries,
+                                                     sizeof(struct bundle_index_entry), bundle_entry_compare);
+
+    if (entry != NULL && bundle_recorded != NULL) {
+        pthread_mutex_lock(&bundle_record_lock);
+        if (bundle_record_file != NULL && !bundle_recorded[entry - bundle_index]) {
+            bundle_recorded[entry - bundle_index] = 1;
+            fprintf(bundle_record_file, "%s\n", path);
+        }
+        pthread_mutex_unlock(&bundle_record_lock);
+    }
+
+    return entry;
+}
+
+// Notes that startup has reached the entry at index, letting the prefetch
+// thread move ahead. Called with bundle_cache_lock held.
+static void bundle_prefetch_advance(uint32_t index) {
+    if (bundle_load_order_pos != NULL && bundle_load_order_pos[index] > bundle_prefetch_consumed) {
+        bundle_prefetch_consumed = bundle_load_order_pos[index];
+        pthread_cond_broadcast(&bundle_prefetch_cond);
+    }
+}
+
+void bundle_boot_complete(void) {
+    pthread_mutex_lock(&bundle_record_lock);
+    if (bundle_record_file != NULL) {
+        fclose(bundle_record_file);
+        bundle_record_file = NULL;
+    }
+    pthread_mutex_unlock(&bundle_record_lock);
+
+    pthread_mutex_lock(&bundle_cache_lock);
+    bundle_prefetch_stopped = true;
+    pthread_cond_broadcast(&bundle_prefetch_cond);
+    pthread_mutex_unlock(&bundle_cache_lock);
+
+    pthread_mutex_lock(&bundle_boot_lock);
+    free(bundle_boot_data);
+    bundle_boot_data = NULL;
+    bundle_boot_files = NULL;
+    pthread_mutex_unlock(&bundle_boot_lock);
+}
+
+size_t bundle_boot_num_files(void) {
+    pthread_once(&bundle_once, bundle_open);
+
+    if (bundle_data == NULL || bundle_header->num_boot_files == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&bundle_boot_lock);
+    if (!bundle_boot_inflated) {
+        bundle_boot_inflated = true;
+
+        bool valid = true;
+        const struct bundle_boot_file *boot_files =
+                (const struct bundle_boot_file *) (bundle_data + bundle_header->boot_files_offset);
+        for (uint32_t i = 0; i < bundle_header->num_boot_files; i++) {
+            valid = valid && boot_files[i].entry < bundle_header->num_entries
+                    && boot_files[i].root < bundle_header->num_entries
+                    && boot_files[i].offset + (size_t) boot_files[i].len <= bundle_header->boot_len;
+        }
+
+        char *data = malloc(bundle_header->boot_len + 1);
+        data[bundle_header->boot_len] = '\0';
+        if (valid && bundle_inflate(data, (unsigned char *) bundle_data + bundle_header->boot_data_offset,
+                                    bundle_header->boot_gz_len, bundle_header->boot_len,
+                                    bundle_data + bundle_header->dict_offset, bundle_header->dict_len) == 0) {
+            bundle_boot_data = data;
+            bundle_boot_files = boot_files;
+        } else {
+            free(data);
+        }
+    }
+    size_t num_files = bundle_boot_files != NULL ? bundle_header->num_boot_files : 0;
+    pthread_mutex_unlock(&bundle_boot_lock);
+
+    return num_files;
+}
+
+char *bundle_boot_file(size_t i, char **root, char **source, const uint16_t **utf16, size_t *len) {
+    const struct bundle_boot_file *boot_file = &bundle_boot_files[i];
+    const struct bundle_index_entry *entry = &bundle_index[boot_file->entry];
+
+    *root = (char *) bundle_data + bundle_index[boot_file->root].path_offset;
+    if (entry->flags & BUNDLE_ENTRY_UTF16) {
+        *source = NULL;
+        *utf16 = (const uint16_t *) (bundle_data + entry->data_offset);
+        *len = entry->len / sizeof(uint16_t);
+    } else {
+        *source = bundle_boot_data + boot_file->offset;
+        *utf16 = NULL;
+        *len = boot_file->len;
+    }
+
+    return (char *) bundle_data + entry->path_offset;
+}
+
+static int bundle_closure_provide_compare(const void *key, const void *provide) {
+    return strcmp(key, (const char *) bundle_data + ((const struct bundle_closure_provide *) provide)->name_offset);
+}
+
+char *bundle_closure_path(char *name) {
+    pthread_once(&bundle_once, bundle_open);
+
+    if (name == NULL || bundle_data == NULL) {
+        return NULL;
+    }
+
+    const struct bundle_closure_provide *provide =
+            bsearch(name, bundle_data + bundle_header->closure_index_offset, bundle_header->num_closure_provides,
+                    sizeof(struct bundle_closure_provide), bundle_closure_provide_compare);
+    if (provide == NULL) {
+        return NULL;
+    }
+
+    const char *path = (const char *) bundle_data + bundle_index[provide->entry].path_offset;
+    size_t len = strlen(path);
+    if (len > 3 && strcmp(path + len - 3, ".js") == 0) {
+        len -= 3;
+    }
+    return strndup(path, len);
+}
+
+// Transcodes a UTF-16 entry back to UTF-8 for callers wanting a C string
+static char *bundle_utf16_to_utf8(const uint16_t *utf16, size_t n) {
+    char *contents = malloc(3 * n + 1);
+    size_t len = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        uint32_t code_point = utf16[i];
+        if (code_point >= 0xD800 && code_point <= 0xDBFF && i + 1 < n
+            && utf16[i + 1] >= 0xDC00 && utf16[i + 1] <= 0xDFFF) {
+            code_point = 0x10000 + ((code_point - 0xD800) << 10) + (utf16[i + 1] - 0xDC00);
+            i++;
+        }
+
+        if (code_point < 0x80) {
+            contents[len++] = (char) code_point;
+        } else if (code_point < 0x800) {
+            contents[len++] = (char) (0xC0 | (code_point >> 6));
+            contents[len++] = (char) (0x80 | (code_point & 0x3F));
+        } else if (code_point < 0x10000) {
+            contents[len++] = (char) (0xE0 | (code_point >> 12));
+            contents[len++] = (char) (0x80 | ((code_point >> 6) & 0x3F));
+            contents[len++] = (char) (0x80 | (code_point & 0x3F));
+        } else {
+            contents[len++] = (char) (0xF0 | (code_point >> 18));
+            contents[len++] = (char) (0x80 | ((code_point >> 12) & 0x3F));
+            contents[len++] = (char) (0x80 | ((code_point >> 6) & 0x3F));
+            contents[len++] = (char) (0x80 | (code_point & 0x3F));
+        }
+    }
+
+    contents[len] = '\0';
+    return contents;
+}
+
+const uint16_t *bundle_get_utf16(char *path, size_t *len) {
+    const struct bundle_index_entry *entry = bundle_lookup(path);
+    if (entry == NULL || !(entry->flags & BUNDLE_ENTRY_UTF16)
+        || entry->data_offset + (size_t) entry->len > bundle_header->size) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&bundle_cache_lock);
+    bundle_prefetch_advance((uint32_t) (entry - bundle_index));
+    pthread_mutex_unlock(&bundle_cache_lock);
+
+    *len = entry->len / sizeof(uint16_t);
+    return (const uint16_t *) (bundle_data + entry->data_offset);
+}
+
+static void bundle_cache_unlink(struct bundle_cache_node *node) {
+    if (node->prev != NULL) {
+        node->prev->next = node->next;
+    } else {
+        bundle_cache_head = node->next;
+    }
+    if (node->next != NULL) {
+        node->next->prev = node->prev;
+    } else {
+        bundle_cache_tail = node->prev;
+    }
+    node->prev = NULL;
+    node->next = NULL;
+}
+
+static void bundle_cache_push_front(struct bundle_cache_node *node) {
+    node->prev = NULL;
+    node->next = bundle_cache_head;
+    if (bundle_cache_head != NULL) {
+        bundle_cache_head->prev = node;
+    }
+    bundle_cache_head = node;
+    if (bundle_cache_tail == NULL) {
+        bundle_cache_tail = node;
+    }
+}
+
+// Returns a copy of the cached contents of the entry at index, or NULL
+static char *bundle_cache_get(uint32_t index) {
+    char *contents = NULL;
+
+    pthread_mutex_lock(&bundle_cache_lock);
+    bundle_prefetch_advance(index);
+    while (bundle_prefetch_in_flight == index) {
+        pthread_cond_wait(&bundle_prefetch_cond, &bundle_cache_lock);
+    }
+    struct bundle_cache_node *node = bundle_cache_nodes[index];
+    if (node != NULL) {
+        bundle_cache_unlink(node);
+        bundle_cache_push_front(node);
+        contents = malloc(node->len + 1);
+        memcpy(contents, node->contents, node->len + 1);
+        bundle_cache_hits++;
+    } else {
+        bundle_cache_misses++;
+    }
+    pthread_mutex_unlock(&bundle_cache_lock);
+
+    return contents;
+}
+
+// Adds contents, which the cache takes ownership of, to the cache.
+// Called with bundle_cache_lock held.
+static void bundle_cache_insert(uint32_t index, char *contents, size_t len) {
+    if (len > bundle_cache_max_size || bundle_cache_nodes[index] != NULL) {
+        free(contents);
+        return;
+    }
+
+    while (bundle_cache_tail != NULL && bundle_cache_size + len > bundle_cache_max_size) {
+        struct bundle_cache_node *evicted = bundle_cache_tail;
+        bundle_cache_unlink(evicted);
+        bundle_cache_nodes[evicted->index] = NULL;
+        bundle_cache_size -= evicted->len;
+        free(evicted->contents);
+        free(evicted);
+    }
+
+    struct bundle_cache_node *node = malloc(sizeof(struct bundle_cache_node));
+    node->index = index;
+    node->contents = contents;
+    node->len = len;
+    bundle_cache_push_front(node);
+    bundle_cache_nodes[index] = node;
+    bundle_cache_size += len;
+}
+
+static void bundle_cache_put(uint32_t index, char *contents, size_t len) {
+    if (len > bundle_cache_max_size) {
+        return;
+    }
+
+    char *copy = malloc(len + 1);
+    memcpy(copy, contents, len + 1);
+
+    pthread_mutex_lock(&bundle_cache_lock);
+    bundle_cache_insert(index, copy, len);
+    pthread_mutex_unlock(&bundle_cache_lock);
+}
+
+void bundle_cache_stats(unsigned long *hits, unsigned long *misses) {
+    pthread_mutex_lock(&bundle_cache_lock);
+    *hits = bundle_cache_hits;
+    *misses = bundle_cache_misses;
+    pthread_mutex_unlock(&bundle_cache_lock);
+}
+
+static char *bundle_read_entry(const struct bundle_index_entry *entry) {
+    if (entry->flags & BUNDLE_ENTRY_UTF16) {
+        return bundle_utf16_to_utf8((const uint16_t *) (bundle_data + entry->data_offset),
+                                    entry->len / sizeof(uint16_t));
+    }
+
+    char *contents = malloc((entry->len + 1) * sizeof(char));
+    memset(contents, 0, entry->len + 1);
+    if (bundle_inflate(contents, (unsigned char *) bundle_data + entry->data_offset, entry->gz_len, entry->len,
+                       bundle_data + bundle_header->dict_offset, bundle_header->dict_len) < 0) {
+        free(contents);
+        return NULL;
+    }
+
+    return contents;
+}
+
+static void *bundle_prefetch(void *data) {
+    pthread_mutex_lock(&bundle_cache_lock);
+    while (!bundle_prefetch_stopped && bundle_prefetch_next < bundle_header->num_load_order) {
+        if (bundle_prefetch_next >= bundle_prefetch_consumed + BUNDLE_PREFETCH_AHEAD) {
+            pthread_cond_wait(&bundle_prefetch_cond, &bundle_cache_lock);
+            continue;
+        }
+
+        uint32_t index = bundle_load_order[bundle_prefetch_next++];
+        if (index >= bundle_header->num_entries || bundle_cache_nodes[index] != NULL
+            || (bundle_index[index].flags & BUNDLE_ENTRY_UTF16)
+            || bundle_index[index].data_offset + (size_t) bundle_index[index].gz_len > bundle_header->size) {
+            continue;
+        }
+
+        bundle_prefetch_in_flight = index;
+        pthread_mutex_unlock(&bundle_cache_lock);
+
+        char *contents = bundle_read_entry(&bundle_index[index]);
+
+        pthread_mutex_lock(&bundle_cache_lock);
+        if (contents != NULL) {
+            bundle_cache_insert(index, contents, strlen(contents));
+        }
+        bundle_prefetch_in_flight = BUNDLE_NONE;
+        pthread_cond_broadcast(&bundle_prefetch_cond);
+    }
+    pthread_mutex_unlock(&bundle_cache_lock);
+
     return NULL;
 }
 
+char *bundle_get_contents(char *path) {
+    const struct bundle_index_entry *entry = bundle_lookup(path);
+    if (entry == NULL || entry->data_offset + (size_t) entry->gz_len > bundle_header->size) {
+        return NULL;
+    }
+
+    uint32_t index = (uint32_t) (entry - bundle_index);
+    char *contents = bundle_cache_get(index);
+    if (contents == NULL) {
+        contents = bundle_read_entry(entry);
+        if (contents != NULL) {
+            bundle_cache_put(index, contents, strlen(contents));
+        }
+    }
+
+    return contents;
+}
+
 #ifdef BUNDLE_TEST
-int main(void) {
-    fprintf(stderr, "no bundled sources, need to run run script/bundle-c\n");
-    return -1;
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        printf("%s <path>\n", argv[0]);
+        exit(1);
+    }
+
+    char *contents = bundle_get_contents(argv[1]);
+    if (contents == NULL) {
+        printf("not in bundle\n");
+        exit(1);
+    }
+
+    printf("%s", contents);
+    free(contents);
+
+    return 0;
 }
 #endif
@@ -1 +1,26 @@
-char *bundle_get_contents(char *path);
\ No newline at end of file
+#include <stddef.h>
+#include <stdint.h>
+
+char *bundle_get_contents(char *path);
+
+// Returns the in-place UTF-16 text of an entry stored as such, or NULL
+const uint16_t *bundle_get_utf16(char *path, size_t *len);
+
+// Called once startup is done, ending load order recording and prefetching
+void bundle_boot_complete(void);
+
+// The files of the pre-linked boot script, in evaluation order (see
+// bundle_format.h), available until bundle_boot_complete is called
+size_t bundle_boot_num_files(void);
+
+// Returns the path of the ith boot file, setting root to the path of the
+// namespace whose closure it belongs to, and either source to its UTF-8
+// text or utf16 and len to its in-place UTF-16 text
+char *bundle_boot_file(size_t i, char **root, char **source, const uint16_t **utf16, size_t *len);
+
+// Returns the path, without the .js extension, of the Closure library file
+// providing name, or NULL if goog/deps.js has no such provide
+char *bundle_closure_path(char *name);
+
+// Hits and misses of the cache of inflated entries
+void bundle_cache_stats(unsigned long *hits, unsigned long *misses);
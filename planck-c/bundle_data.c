@@ -0,0 +1,26 @@
+// Embeds the bundle archive written by script/bundle-c in its own read-only
+// section. The archive is referenced in place (see bundle.c), so only the
+// pages holding the index and the entries actually loaded are faulted in.
+
+#ifndef PLANCK_BUNDLE_PATH
+#error "PLANCK_BUNDLE_PATH must name the bundle archive to embed"
+#endif
+
+#ifdef __APPLE__
+#define BUNDLE_SECTION "__TEXT,__planck_bundle"
+#define BUNDLE_SYMBOL(name) "_" #name
+#else
+#define BUNDLE_SECTION ".planck_bundle, \"a\""
+#define BUNDLE_SYMBOL(name) #name
+#endif
+
+__asm__(
+    ".pushsection " BUNDLE_SECTION "\n"
+    ".balign 16\n"
+    ".globl " BUNDLE_SYMBOL(bundle_data_start) "\n"
+    BUNDLE_SYMBOL(bundle_data_start) ":\n"
+    ".incbin \"" PLANCK_BUNDLE_PATH "\"\n"
+    ".globl " BUNDLE_SYMBOL(bundle_data_end) "\n"
+    BUNDLE_SYMBOL(bundle_data_end) ":\n"
+    ".popsection\n"
+);
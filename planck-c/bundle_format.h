@@ -0,0 +1,77 @@
+// Layout of the bundle archive written by bundle_pack and read by bundle.c
+//
+// An archive is a header, followed by an index of entries sorted by path
+// (in strcmp order, so that it can be binary searched in place), a table
+// of NUL-terminated paths, a preset deflate dictionary shared by all of
+// the entries, the boot load order (the indexes of the entries in the order
+// a normal startup loads them, recorded at build time), the table of files
+// making up the pre-linked boot script, the Closure provide index and its
+// names, the deflated entry data and finally the deflated boot script. All
+// offsets are relative to the start of the archive, and all integers are
+// stored in the byte order of the machine that built the archive.
+
+#include <stdint.h>
+
+#define BUNDLE_MAGIC "PLNKBNDL"
+#define BUNDLE_MAGIC_LEN 8
+#define BUNDLE_VERSION 6
+
+// The largest dictionary deflate can make use of
+#define BUNDLE_DICT_MAX 32768
+
+struct bundle_header {
+    char magic[BUNDLE_MAGIC_LEN];
+    uint32_t version;
+    uint32_t num_entries;
+    uint32_t index_offset;
+    uint32_t paths_offset;
+    uint32_t dict_offset;
+    uint32_t dict_len;
+    uint32_t load_order_offset;
+    uint32_t num_load_order;
+    uint32_t boot_files_offset;
+    uint32_t num_boot_files;
+    uint32_t closure_index_offset;
+    uint32_t num_closure_provides;
+    uint32_t boot_data_offset;
+    uint32_t boot_gz_len;
+    uint32_t boot_len;
+    uint32_t data_offset;
+    uint32_t size;
+};
+
+struct bundle_index_entry {
+    uint32_t path_offset;
+    uint32_t data_offset;
+    uint32_t gz_len;
+    uint32_t len;
+    uint32_t flags;
+};
+
+// The entry is stored uncompressed as UTF-16 in host byte order (gz_len and
+// len are both its size in bytes), so that it can be handed to JavaScriptCore
+// without inflating or transcoding it. Used for the large boot-time sources.
+#define BUNDLE_ENTRY_UTF16 0x1
+
+// The pre-linked boot script is the transitive closure of the namespaces
+// loaded at startup (cljs.core, planck.repl), in dependency order, so that
+// it can be evaluated without going through goog.require file by file. It
+// is stored as one deflated blob of NUL-terminated sources (offset and len
+// locate a file's source within it), apart from files stored as UTF-16,
+// which are used in place. root is the entry of the namespace whose
+// closure first brought in the file.
+struct bundle_boot_file {
+    uint32_t entry;
+    uint32_t root;
+    uint32_t offset;
+    uint32_t len;
+};
+
+// The Closure provide index maps each name provided in goog/deps.js to the
+// entry of the file providing it, sorted by name (in strcmp order, for
+// binary search), so that the loader needn't scan goog/deps.js to find
+// Closure libraries. name_offset locates a NUL-terminated name.
+struct bundle_closure_provide {
+    uint32_t name_offset;
+    uint32_t entry;
+};
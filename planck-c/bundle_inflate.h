@@ -4,7 +4,10 @@
 
 #include <zlib.h>
 
-int bundle_inflate(char *dest, unsigned char *src, unsigned int src_len, unsigned int len) {
+// Inflates a gzip or zlib stream, supplying dict if the stream was
+// deflated with a preset dictionary
+int bundle_inflate(char *dest, unsigned char *src, unsigned int src_len, unsigned int len,
+                   const unsigned char *dict, unsigned int dict_len) {
     if (src_len == 0) {
         return 0;
     }
@@ -30,6 +33,10 @@ int bundle_inflate(char *dest, unsigned char *src, unsigned int src_len, unsigne
         status = inflate(&strm, Z_SYNC_FLUSH);
         if (status == Z_STREAM_END) {
             done = true;
+        } else if (status == Z_NEED_DICT && dict != NULL) {
+            if (inflateSetDictionary(&strm, dict, dict_len) != Z_OK) {
+                break;
+            }
         } else if (status != Z_OK) {
             break;
         }
@@ -0,0 +1,842 @@
+// Packs files into a bundle archive (see bundle_format.h)
+//
+// Used by planck-cljs/script/bundle-c at build time; this is not part of
+// the planck binary. Reads the relative paths of the files to bundle from
+// standard input, one per line, and writes the archive to the path given
+// as the first argument. Any further arguments name entries to be stored
+// as UTF-16 rather than deflated (see BUNDLE_ENTRY_UTF16). The -l option
+// names a file listing the paths loaded at startup, in order, as recorded
+// by running planck with PLANCK_BUNDLE_RECORD_LOAD_ORDER set. Each -b option
+// names a namespace whose transitive closure goes into the pre-linked boot
+// script, worked out from main.js and goog/deps.js in the current directory.
+
+// For memmem
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "bundle_format.h"
+
+struct pack_entry {
+    char *path;
+    unsigned char *contents;
+    unsigned char *gz_data;
+    uint32_t gz_len;
+    uint32_t len;
+    uint32_t flags;
+    uint32_t data_offset;
+};
+
+int compare_pack_entries(const void *a, const void *b) {
+    return strcmp(((struct pack_entry *) a)->path, ((struct pack_entry *) b)->path);
+}
+
+unsigned char *read_file(char *path, uint32_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+
+    struct stat f_stat;
+    if (fstat(fileno(f), &f_stat) < 0) {
+        fclose(f);
+        return NULL;
+    }
+
+    unsigned char *buf = malloc((size_t) f_stat.st_size + 1);
+    if (fread(buf, 1, (size_t) f_stat.st_size, f) != (size_t) f_stat.st_size) {
+        free(buf);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+
+    *len = (uint32_t) f_stat.st_size;
+    return buf;
+}
+
+// Dictionary training
+//
+// Most entries are small files sharing a lot of vocabulary (cljs.core.,
+// goog., transit keys), which deflate can't exploit when each entry is
+// compressed on its own. We count, for fixed-length strings starting at
+// token boundaries, the number of files they occur in, and fill the
+// dictionary with the most widely shared ones. Deflate finds matches more
+// cheaply near the end of the dictionary, so the most common strings are
+// placed last.
+
+#define DICT_SAMPLE_LEN 24
+#define DICT_SAMPLE_MAX_FILE_LEN 65536
+#define DICT_TABLE_SIZE (1 << 20)
+
+struct dict_candidate {
+    uint64_t hash;
+    uint32_t count;
+    uint32_t last_file;
+    unsigned char *bytes;
+};
+
+int is_word_char(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '$' || c >= 0x80;
+}
+
+uint64_t hash_bytes(unsigned char *bytes, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+int compare_dict_candidates(const void *a, const void *b) {
+    const struct dict_candidate *ca = a;
+    const struct dict_candidate *cb = b;
+    if (ca->count != cb->count) {
+        return ca->count < cb->count ? 1 : -1;
+    }
+    return memcmp(ca->bytes, cb->bytes, DICT_SAMPLE_LEN);
+}
+
+unsigned char *train_dict(struct pack_entry *entries, size_t num_entries, uint32_t *dict_len) {
+    struct dict_candidate *table = calloc(DICT_TABLE_SIZE, sizeof(struct dict_candidate));
+    size_t num_candidates = 0;
+
+    for (size_t i = 0; i < num_entries; i++) {
+        unsigned char *contents = entries[i].contents;
+        uint32_t len = entries[i].len;
+        if (len > DICT_SAMPLE_MAX_FILE_LEN) {
+            continue;
+        }
+
+        for (uint32_t offset = 0; offset + DICT_SAMPLE_LEN <= len; offset++) {
+            if (offset > 0 && is_word_char(contents[offset - 1])) {
+                continue;
+            }
+
+            uint64_t hash = hash_bytes(contents + offset, DICT_SAMPLE_LEN);
+            size_t slot = hash & (DICT_TABLE_SIZE - 1);
+            while (table[slot].bytes != NULL &&
+                   (table[slot].hash != hash || memcmp(table[slot].bytes, contents + offset, DICT_SAMPLE_LEN) != 0)) {
+                slot = (slot + 1) & (DICT_TABLE_SIZE - 1);
+            }
+
+            if (table[slot].bytes == NULL) {
+                // Stop admitting new strings once the table is mostly full
+                if (num_candidates >= DICT_TABLE_SIZE / 4 * 3) {
+                    continue;
+                }
+                table[slot].hash = hash;
+                table[slot].bytes = contents + offset;
+                table[slot].count = 1;
+                table[slot].last_file = (uint32_t) i;
+                num_candidates++;
+            } else if (table[slot].last_file != i) {
+                table[slot].count++;
+                table[slot].last_file = (uint32_t) i;
+            }
+        }
+    }
+
+    size_t num_shared = 0;
+    for (size_t i = 0; i < DICT_TABLE_SIZE; i++) {
+        if (table[i].bytes != NULL && table[i].count > 1) {
+            table[num_shared++] = table[i];
+        }
+    }
+    qsort(table, num_shared, sizeof(struct dict_candidate), compare_dict_candidates);
+
+    // Select the most shared strings, skipping any already covered
+    unsigned char *selected = malloc(BUNDLE_DICT_MAX);
+    size_t selected_len = 0;
+    size_t *chosen = malloc(BUNDLE_DICT_MAX / DICT_SAMPLE_LEN * sizeof(size_t));
+    size_t num_chosen = 0;
+    for (size_t i = 0; i < num_shared && selected_len + DICT_SAMPLE_LEN <= BUNDLE_DICT_MAX; i++) {
+        if (memmem(selected, selected_len, table[i].bytes, DICT_SAMPLE_LEN) != NULL) {
+            continue;
+        }
+        memcpy(selected + selected_len, table[i].bytes, DICT_SAMPLE_LEN);
+        selected_len += DICT_SAMPLE_LEN;
+        chosen[num_chosen++] = i;
+    }
+    free(selected);
+
+    // Lay them out least shared first
+    unsigned char *dict = malloc(BUNDLE_DICT_MAX);
+    *dict_len = 0;
+    for (size_t i = num_chosen; i > 0; i--) {
+        memcpy(dict + *dict_len, table[chosen[i - 1]].bytes, DICT_SAMPLE_LEN);
+        *dict_len += DICT_SAMPLE_LEN;
+    }
+
+    free(chosen);
+    free(table);
+    return dict;
+}
+
+unsigned char *deflate_contents(unsigned char *contents, uint32_t len, unsigned char *dict, uint32_t dict_len,
+                                uint32_t *gz_len) {
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+
+    // A zlib (rather than gzip) wrapper is needed to carry the dictionary
+    // id; bundle_inflate auto-detects either
+    if (deflateInit2(&strm, 9, Z_DEFLATED, 15, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+
+    if (dict_len > 0 && deflateSetDictionary(&strm, dict, dict_len) != Z_OK) {
+        deflateEnd(&strm);
+        return NULL;
+    }
+
+    uLong bound = deflateBound(&strm, len);
+    unsigned char *gz_data = malloc(bound);
+
+    strm.next_in = contents;
+    strm.avail_in = len;
+    strm.next_out = gz_data;
+    strm.avail_out = (uInt) bound;
+
+    if (deflate(&strm, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&strm);
+        free(gz_data);
+        return NULL;
+    }
+
+    *gz_len = (uint32_t) strm.total_out;
+    deflateEnd(&strm);
+    return gz_data;
+}
+
+// Compresses with the dictionary, unless the entry comes out smaller without it
+unsigned char *compress_entry(struct pack_entry *entry, unsigned char *dict, uint32_t dict_len, uint32_t *gz_len) {
+    unsigned char *with_dict = deflate_contents(entry->contents, entry->len, dict, dict_len, gz_len);
+    if (with_dict == NULL || dict_len == 0) {
+        return with_dict;
+    }
+
+    uint32_t plain_len = 0;
+    unsigned char *plain = deflate_contents(entry->contents, entry->len, NULL, 0, &plain_len);
+    if (plain != NULL && plain_len < *gz_len) {
+        free(with_dict);
+        *gz_len = plain_len;
+        return plain;
+    }
+
+    free(plain);
+    return with_dict;
+}
+
+// Transcodes UTF-8 to UTF-16 in host byte order, as JavaScriptCore expects.
+// Malformed sequences become U+FFFD.
+unsigned char *encode_utf16(unsigned char *contents, uint32_t len, uint32_t *utf16_len) {
+    uint16_t *utf16 = malloc(((size_t) len + 1) * sizeof(uint16_t));
+    size_t n = 0;
+
+    uint32_t i = 0;
+    while (i < len) {
+        unsigned char c = contents[i];
+        uint32_t code_point = 0xFFFD;
+        uint32_t extra = 0;
+        if (c < 0x80) {
+            code_point = c;
+        } else if ((c & 0xE0) == 0xC0) {
+            code_point = c & 0x1F;
+            extra = 1;
+        } else if ((c & 0xF0) == 0xE0) {
+            code_point = c & 0x0F;
+            extra = 2;
+        } else if ((c & 0xF8) == 0xF0) {
+            code_point = c & 0x07;
+            extra = 3;
+        }
+        i++;
+
+        for (uint32_t j = 0; j < extra; j++) {
+            if (i >= len || (contents[i] & 0xC0) != 0x80) {
+                code_point = 0xFFFD;
+                break;
+            }
+            code_point = (code_point << 6) | (contents[i] & 0x3F);
+            i++;
+        }
+
+        if (code_point >= 0x10000 && code_point <= 0x10FFFF) {
+            code_point -= 0x10000;
+            utf16[n++] = (uint16_t) (0xD800 + (code_point >> 10));
+            utf16[n++] = (uint16_t) (0xDC00 + (code_point & 0x3FF));
+        } else if (code_point > 0x10FFFF) {
+            utf16[n++] = 0xFFFD;
+        } else {
+            utf16[n++] = (uint16_t) code_point;
+        }
+    }
+
+    *utf16_len = (uint32_t) (n * sizeof(uint16_t));
+    return (unsigned char *) utf16;
+}
+
+int is_utf16_path(char *path, int first, int argc, char **argv) {
+    for (int i = first; i < argc; i++) {
+        if (strcmp(path, argv[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+char *read_line(FILE *f) {
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n = getline(&line, &cap, f);
+    if (n <= 0) {
+        free(line);
+        return NULL;
+    }
+    if (line[n - 1] == '\n') {
+        line[n - 1] = '\0';
+    }
+    return line;
+}
+
+int compare_path_to_pack_entry(const void *key, const void *entry) {
+    return strcmp(key, ((struct pack_entry *) entry)->path);
+}
+
+// Reads a recorded load order, returning the indexes of the entries it lists
+uint32_t *read_load_order(char *path, struct pack_entry *entries, size_t num_entries, uint32_t *num_load_order) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return NULL;
+    }
+
+    uint32_t *load_order = malloc(num_entries * sizeof(uint32_t));
+    char *seen = calloc(num_entries, 1);
+    *num_load_order = 0;
+
+    char *line = NULL;
+    while ((line = read_line(f)) != NULL) {
+        struct pack_entry *entry = bsearch(line, entries, num_entries, sizeof(struct pack_entry),
+                                           compare_path_to_pack_entry);
+        free(line);
+        if (entry == NULL) {
+            continue;
+        }
+
+        size_t index = (size_t) (entry - entries);
+        if (!seen[index]) {
+            seen[index] = 1;
+            load_order[(*num_load_order)++] = (uint32_t) index;
+        }
+    }
+
+    free(seen);
+    fclose(f);
+    return load_order;
+}
+
+// Pre-linked boot script
+
+struct dep {
+    char *path;
+    char **requires;
+    size_t num_requires;
+    int visited;
+};
+
+struct provide {
+    char *name;
+    size_t dep;
+};
+
+struct boot_file {
+    size_t entry;
+    size_t root;
+    uint32_t offset;
+    uint32_t len;
+};
+
+// Ties are broken by order of appearance, so that the last of several
+// provides of a name can be picked out
+int compare_provides(const void *a, const void *b) {
+    const struct provide *pa = a;
+    const struct provide *pb = b;
+    int cmp = strcmp(pa->name, pb->name);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return pa->dep < pb->dep ? -1 : pa->dep > pb->dep;
+}
+
+int compare_provide_names(const void *key, const void *provide) {
+    return strcmp(key, ((struct provide *) provide)->name);
+}
+
+// Reads the next quoted string at or after *p, provided no stop character
+// comes first
+char *parse_quoted(char **p, char stop) {
+    char *s = *p;
+    while (*s != '\0' && *s != '\'' && *s != '"') {
+        if (*s == stop) {
+            return NULL;
+        }
+        s++;
+    }
+    if (*s == '\0') {
+        return NULL;
+    }
+
+    char quote = *s++;
+    char *end = strchr(s, quote);
+    if (end == NULL) {
+        return NULL;
+    }
+
+    *p = end + 1;
+    return strndup(s, (size_t) (end - s));
+}
+
+// Parses a bracketed list of quoted strings
+char **parse_list(char **p, size_t *n) {
+    char **list = NULL;
+    *n = 0;
+
+    char *open = strchr(*p, '[');
+    if (open == NULL) {
+        return NULL;
+    }
+    *p = open + 1;
+
+    char *s = NULL;
+    while ((s = parse_quoted(p, ']')) != NULL) {
+        list = realloc(list, (*n + 1) * sizeof(char *));
+        list[(*n)++] = s;
+    }
+
+    char *close = strchr(*p, ']');
+    if (close != NULL) {
+        *p = close + 1;
+    }
+    return list;
+}
+
+// Paths in deps files are relative to goog/, as for CLOSURE_IMPORT_SCRIPT
+char *dep_path_to_bundle_path(char *path) {
+    char *bundle_path = malloc(strlen(path) + 6);
+    sprintf(bundle_path, "goog/%s", path);
+    if (strncmp(bundle_path, "goog/../", 8) == 0) {
+        memmove(bundle_path, bundle_path + 8, strlen(bundle_path + 8) + 1);
+    }
+    return bundle_path;
+}
+
+void read_deps(char *deps_path, struct dep **deps, size_t *num_deps, struct provide **provides, size_t *num_provides) {
+    uint32_t len = 0;
+    char *contents = (char *) read_file(deps_path, &len);
+    if (contents == NULL) {
+        return;
+    }
+    contents[len] = '\0';
+
+    char *p = contents;
+    while ((p = strstr(p, "goog.addDependency(")) != NULL) {
+        p += strlen("goog.addDependency(");
+
+        char *path = parse_quoted(&p, ')');
+        if (path == NULL) {
+            continue;
+        }
+
+        size_t num_names = 0;
+        char **names = parse_list(&p, &num_names);
+
+        *deps = realloc(*deps, (*num_deps + 1) * sizeof(struct dep));
+        struct dep *dep = &(*deps)[*num_deps];
+        dep->path = dep_path_to_bundle_path(path);
+        dep->requires = parse_list(&p, &dep->num_requires);
+        dep->visited = 0;
+        free(path);
+
+        for (size_t i = 0; i < num_names; i++) {
+            *provides = realloc(*provides, (*num_provides + 1) * sizeof(struct provide));
+            (*provides)[*num_provides].name = names[i];
+            (*provides)[*num_provides].dep = *num_deps;
+            (*num_provides)++;
+        }
+        free(names);
+
+        (*num_deps)++;
+    }
+
+    free(contents);
+}
+
+struct dep *find_provider(char *name, struct dep *deps, struct provide *provides, size_t num_provides) {
+    struct provide *provide = bsearch(name, provides, num_provides, sizeof(struct provide), compare_provide_names);
+    return provide == NULL ? NULL : &deps[provide->dep];
+}
+
+// Appends dep's file to the boot script after those of its requires
+void visit_dep(struct dep *dep, size_t root, struct dep *deps, struct provide *provides, size_t num_provides,
+               struct pack_entry *entries, size_t num_entries, struct boot_file **boot_files, size_t *num_boot_files) {
+    if (dep->visited) {
+        return;
+    }
+    dep->visited = 1;
+
+    for (size_t i = 0; i < dep->num_requires; i++) {
+        struct dep *required = find_provider(dep->requires[i], deps, provides, num_provides);
+        if (required != NULL) {
+            visit_dep(required, root, deps, provides, num_provides, entries, num_entries, boot_files, num_boot_files);
+        }
+    }
+
+    // goog/base.js is evaluated before anything can be required
+    if (strcmp(dep->path, "goog/base.js") == 0) {
+        return;
+    }
+
+    struct pack_entry *entry = bsearch(dep->path, entries, num_entries, sizeof(struct pack_entry),
+                                       compare_path_to_pack_entry);
+    if (entry == NULL) {
+        fprintf(stderr, "Not bundled, leaving out of boot script: %s\n", dep->path);
+        return;
+    }
+
+    *boot_files = realloc(*boot_files, (*num_boot_files + 1) * sizeof(struct boot_file));
+    (*boot_files)[*num_boot_files].entry = (size_t) (entry - entries);
+    (*boot_files)[*num_boot_files].root = root;
+    (*num_boot_files)++;
+}
+
+struct boot_file *link_boot_script(char **roots, size_t num_roots, struct dep *deps, struct provide *provides,
+                                   size_t num_provides, struct pack_entry *entries, size_t num_entries,
+                                   size_t *num_boot_files) {
+    struct boot_file *boot_files = NULL;
+    *num_boot_files = 0;
+    for (size_t i = 0; i < num_roots; i++) {
+        struct dep *dep = find_provider(roots[i], deps, provides, num_provides);
+        struct pack_entry *entry = NULL;
+        if (dep != NULL) {
+            entry = bsearch(dep->path, entries, num_entries, sizeof(struct pack_entry), compare_path_to_pack_entry);
+        }
+        if (entry == NULL) {
+            fprintf(stderr, "Could not find %s, leaving out of boot script\n", roots[i]);
+            continue;
+        }
+
+        visit_dep(dep, (size_t) (entry - entries), deps, provides, num_provides, entries, num_entries,
+                  &boot_files, num_boot_files);
+    }
+
+    return boot_files;
+}
+
+// Closure provide index
+
+struct closure_provide {
+    char *name;
+    uint32_t entry;
+};
+
+// Maps the sorted provides to the entries of the files providing them. Where
+// a name is provided more than once, the last provide wins, as it would when
+// goog/deps.js is evaluated.
+struct closure_provide *closure_index(struct dep *deps, struct provide *provides, size_t num_provides,
+                                      struct pack_entry *entries, size_t num_entries, size_t *num_closure_provides) {
+    struct closure_provide *closure_provides = malloc((num_provides + 1) * sizeof(struct closure_provide));
+    *num_closure_provides = 0;
+
+    for (size_t i = 0; i < num_provides; i++) {
+        if (i + 1 < num_provides && strcmp(provides[i].name, provides[i + 1].name) == 0) {
+            continue;
+        }
+
+        struct pack_entry *entry = bsearch(deps[provides[i].dep].path, entries, num_entries,
+                                           sizeof(struct pack_entry), compare_path_to_pack_entry);
+        if (entry != NULL) {
+            closure_provides[*num_closure_provides].name = provides[i].name;
+            closure_provides[*num_closure_provides].entry = (uint32_t) (entry - entries);
+            (*num_closure_provides)++;
+        }
+    }
+
+    return closure_provides;
+}
+
+// Concatenates the sources of the boot files not stored as UTF-16
+unsigned char *boot_script_data(struct boot_file *boot_files, size_t num_boot_files, struct pack_entry *entries,
+                                uint32_t *len) {
+    *len = 0;
+    for (size_t i = 0; i < num_boot_files; i++) {
+        struct pack_entry *entry = &entries[boot_files[i].entry];
+        if (!(entry->flags & BUNDLE_ENTRY_UTF16)) {
+            *len += entry->len + 1;
+        }
+    }
+
+    unsigned char *data = malloc(*len + 1);
+    uint32_t offset = 0;
+    for (size_t i = 0; i < num_boot_files; i++) {
+        struct pack_entry *entry = &entries[boot_files[i].entry];
+        if (entry->flags & BUNDLE_ENTRY_UTF16) {
+            boot_files[i].offset = 0;
+            boot_files[i].len = 0;
+            continue;
+        }
+        memcpy(data + offset, entry->contents, entry->len);
+        boot_files[i].offset = offset;
+        boot_files[i].len = entry->len;
+        offset += entry->len;
+        data[offset++] = '\0';
+    }
+
+    return data;
+}
+
+uint32_t align4(uint32_t offset) {
+    return (offset + 3) & ~3u;
+}
+
+void write_padding(FILE *f, uint32_t from, uint32_t to) {
+    for (uint32_t i = from; i < to; i++) {
+        fputc(0, f);
+    }
+}
+
+int main(int argc, char **argv) {
+    char *load_order_path = NULL;
+    char **boot_roots = NULL;
+    size_t num_boot_roots = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "l:b:")) != -1) {
+        switch (opt) {
+            case 'l':
+                load_order_path = optarg;
+                break;
+            case 'b':
+                boot_roots = realloc(boot_roots, (num_boot_roots + 1) * sizeof(char *));
+                boot_roots[num_boot_roots++] = optarg;
+                break;
+            default:
+                return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "%s [-l load-order] [-b boot-ns ...] <archive> [utf16-path ...]"
+                "  (paths to bundle are read from stdin)\n", argv[0]);
+        return 1;
+    }
+    char *archive_path = argv[optind];
+
+    size_t num_entries = 0;
+    struct pack_entry *entries = NULL;
+
+    char *path = NULL;
+    while ((path = read_line(stdin)) != NULL) {
+        if (path[0] == '\0') {
+            free(path);
+            continue;
+        }
+
+        uint32_t len = 0;
+        unsigned char *contents = read_file(path, &len);
+        if (contents == NULL) {
+            fprintf(stderr, "Could not read %s\n", path);
+            return 1;
+        }
+
+        num_entries += 1;
+        entries = realloc(entries, num_entries * sizeof(struct pack_entry));
+        entries[num_entries - 1].path = path;
+        entries[num_entries - 1].contents = contents;
+        entries[num_entries - 1].len = len;
+        entries[num_entries - 1].flags = is_utf16_path(path, optind + 1, argc, argv) ? BUNDLE_ENTRY_UTF16 : 0;
+    }
+
+    qsort(entries, num_entries, sizeof(struct pack_entry), compare_pack_entries);
+
+    uint32_t num_load_order = 0;
+    uint32_t *load_order = NULL;
+    if (load_order_path != NULL) {
+        load_order = read_load_order(load_order_path, entries, num_entries, &num_load_order);
+        if (load_order == NULL) {
+            return 1;
+        }
+    }
+
+    uint32_t dict_len = 0;
+    unsigned char *dict = train_dict(entries, num_entries, &dict_len);
+
+    // The Closure index is of goog/deps.js alone, while the boot script also
+    // links the namespaces in main.js
+    struct dep *deps = NULL;
+    size_t num_deps = 0;
+    struct provide *provides = NULL;
+    size_t num_provides = 0;
+    read_deps("goog/deps.js", &deps, &num_deps, &provides, &num_provides);
+    qsort(provides, num_provides, sizeof(struct provide), compare_provides);
+    size_t num_closure_provides = 0;
+    struct closure_provide *closure_provides = closure_index(deps, provides, num_provides, entries, num_entries,
+                                                             &num_closure_provides);
+
+    read_deps("main.js", &deps, &num_deps, &provides, &num_provides);
+    qsort(provides, num_provides, sizeof(struct provide), compare_provides);
+    size_t num_boot_files = 0;
+    struct boot_file *boot_files = link_boot_script(boot_roots, num_boot_roots, deps, provides, num_provides,
+                                                    entries, num_entries, &num_boot_files);
+    uint32_t boot_len = 0;
+    unsigned char *boot_data = boot_script_data(boot_files, num_boot_files, entries, &boot_len);
+    uint32_t boot_gz_len = 0;
+    unsigned char *boot_gz_data = NULL;
+    if (boot_len > 0) {
+        boot_gz_data = deflate_contents(boot_data, boot_len, dict, dict_len, &boot_gz_len);
+        if (boot_gz_data == NULL) {
+            fprintf(stderr, "Could not compress the boot script\n");
+            return 1;
+        }
+    }
+
+    for (size_t i = 0; i < num_entries; i++) {
+        if (entries[i].flags & BUNDLE_ENTRY_UTF16) {
+            entries[i].gz_data = encode_utf16(entries[i].contents, entries[i].len, &entries[i].gz_len);
+            entries[i].len = entries[i].gz_len;
+            continue;
+        }
+        entries[i].gz_data = compress_entry(&entries[i], dict, dict_len, &entries[i].gz_len);
+        if (entries[i].gz_data == NULL) {
+            fprintf(stderr, "Could not compress %s\n", entries[i].path);
+            return 1;
+        }
+    }
+
+    // Lay out the archive
+
+    struct bundle_header header;
+    memcpy(header.magic, BUNDLE_MAGIC, BUNDLE_MAGIC_LEN);
+    header.version = BUNDLE_VERSION;
+    header.num_entries = (uint32_t) num_entries;
+    header.index_offset = align4(sizeof(struct bundle_header));
+    header.paths_offset = header.index_offset + (uint32_t) (num_entries * sizeof(struct bundle_index_entry));
+
+    uint32_t paths_len = 0;
+    for (size_t i = 0; i < num_entries; i++) {
+        paths_len += (uint32_t) strlen(entries[i].path) + 1;
+    }
+    header.dict_offset = header.paths_offset + paths_len;
+    header.dict_len = dict_len;
+    header.load_order_offset = align4(header.dict_offset + dict_len);
+    header.num_load_order = num_load_order;
+    header.boot_files_offset = align4(header.load_order_offset + num_load_order * (uint32_t) sizeof(uint32_t));
+    header.num_boot_files = (uint32_t) num_boot_files;
+    header.closure_index_offset = header.boot_files_offset +
+                                  (uint32_t) (num_boot_files * sizeof(struct bundle_boot_file));
+    header.num_closure_provides = (uint32_t) num_closure_provides;
+
+    uint32_t closure_names_offset = header.closure_index_offset +
+                                    (uint32_t) (num_closure_provides * sizeof(struct bundle_closure_provide));
+    uint32_t closure_names_len = 0;
+    for (size_t i = 0; i < num_closure_provides; i++) {
+        closure_names_len += (uint32_t) strlen(closure_provides[i].name) + 1;
+    }
+    header.data_offset = closure_names_offset + closure_names_len;
+
+    // UTF-16 entries are aligned so that they can be used in place
+    uint32_t data_end = header.data_offset;
+    for (size_t i = 0; i < num_entries; i++) {
+        if (entries[i].flags & BUNDLE_ENTRY_UTF16) {
+            data_end = align4(data_end);
+        }
+        entries[i].data_offset = data_end;
+        data_end += entries[i].gz_len;
+    }
+    header.boot_data_offset = data_end;
+    header.boot_gz_len = boot_gz_len;
+    header.boot_len = boot_len;
+    header.size = data_end + boot_gz_len;
+
+    // Write it out
+
+    FILE *f = fopen(archive_path, "wb");
+    if (f == NULL) {
+        perror(archive_path);
+        return 1;
+    }
+
+    fwrite(&header, sizeof(struct bundle_header), 1, f);
+    write_padding(f, sizeof(struct bundle_header), header.index_offset);
+
+    uint32_t path_offset = header.paths_offset;
+    for (size_t i = 0; i < num_entries; i++) {
+        struct bundle_index_entry index_entry;
+        index_entry.path_offset = path_offset;
+        index_entry.data_offset = entries[i].data_offset;
+        index_entry.gz_len = entries[i].gz_len;
+        index_entry.len = entries[i].len;
+        index_entry.flags = entries[i].flags;
+        fwrite(&index_entry, sizeof(struct bundle_index_entry), 1, f);
+
+        path_offset += (uint32_t) strlen(entries[i].path) + 1;
+    }
+
+    for (size_t i = 0; i < num_entries; i++) {
+        fwrite(entries[i].path, 1, strlen(entries[i].path) + 1, f);
+    }
+
+    fwrite(dict, 1, dict_len, f);
+    write_padding(f, header.dict_offset + dict_len, header.load_order_offset);
+
+    fwrite(load_order, sizeof(uint32_t), num_load_order, f);
+    write_padding(f, header.load_order_offset + num_load_order * (uint32_t) sizeof(uint32_t),
+                  header.boot_files_offset);
+
+    for (size_t i = 0; i < num_boot_files; i++) {
+        struct bundle_boot_file boot_file;
+        boot_file.entry = (uint32_t) boot_files[i].entry;
+        boot_file.root = (uint32_t) boot_files[i].root;
+        boot_file.offset = boot_files[i].offset;
+        boot_file.len = boot_files[i].len;
+        fwrite(&boot_file, sizeof(struct bundle_boot_file), 1, f);
+    }
+
+    uint32_t name_offset = closure_names_offset;
+    for (size_t i = 0; i < num_closure_provides; i++) {
+        struct bundle_closure_provide closure_provide;
+        closure_provide.name_offset = name_offset;
+        closure_provide.entry = closure_provides[i].entry;
+        fwrite(&closure_provide, sizeof(struct bundle_closure_provide), 1, f);
+
+        name_offset += (uint32_t) strlen(closure_provides[i].name) + 1;
+    }
+
+    for (size_t i = 0; i < num_closure_provides; i++) {
+        fwrite(closure_provides[i].name, 1, strlen(closure_provides[i].name) + 1, f);
+    }
+
+    uint32_t written = header.data_offset;
+    for (size_t i = 0; i < num_entries; i++) {
+        write_padding(f, written, entries[i].data_offset);
+        fwrite(entries[i].gz_data, 1, entries[i].gz_len, f);
+        written = entries[i].data_offset + entries[i].gz_len;
+    }
+
+    fwrite(boot_gz_data, 1, boot_gz_len, f);
+
+    if (ferror(f) || fclose(f) != 0) {
+        perror(archive_path);
+        return 1;
+    }
+
+    return 0;
+}
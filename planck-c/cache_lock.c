@@ -0,0 +1,185 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "cache_lock.h"
+#include "globals.h"
+#include "str.h"
+
+// Each namespace has a lock file alongside its cache files, named for its
+// cache prefix, held with flock(2) while it is compiled and until what was
+// compiled is written. The kernel releases the lock if the process dies, so
+// a lock is never left held. Lock files themselves are removed, along with
+// the rest of their entry, by pruning (see cache_prune.c), which holds the
+// lock as it does so. A process that opened the file just before then ends
+// up locking a file no longer in the cache directory, so having locked it,
+// it checks that it is still the file at its path, and starts over if not.
+//
+// As a flock(2) lock is held by an open file rather than a process, the
+// locks this process holds are tracked, both to make them reentrant and to
+// find them again to release.
+//
+// A process waits on a lock for at most CACHE_LOCK_TIMEOUT seconds, after
+// which it goes ahead and compiles without it. This is only ever wasted
+// work: cache files are replaced atomically whatever the locks.
+
+#define CACHE_LOCK_TIMEOUT 60
+#define CACHE_LOCK_POLL_MS 20
+
+struct cache_lock {
+    char *cache_prefix;
+    int fd;
+    int holds;
+    struct cache_lock *next;
+};
+
+static pthread_mutex_t cache_lock_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_lock *held_locks = NULL;
+
+static struct cache_lock *find_held(char *cache_prefix) {
+    for (struct cache_lock *lock = held_locks; lock != NULL; lock = lock->next) {
+        if (strcmp(lock->cache_prefix, cache_prefix) == 0) {
+            return lock;
+        }
+    }
+    return NULL;
+}
+
+static int flock_retrying(int fd, int operation) {
+    int rv;
+    do {
+        rv = flock(fd, operation);
+    } while (rv == -1 && errno == EINTR);
+    return rv;
+}
+
+// Opens the lock file at path, creating it if need be, and locks it with
+// operation, retrying if the file locked has since been removed or replaced.
+// Returns a descriptor, or -1 with errno set.
+static int open_locked(char *path, int operation) {
+    for (;;) {
+        int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            return -1;
+        }
+
+        if (flock_retrying(fd, operation) != 0) {
+            int err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+
+        struct stat fd_stat;
+        struct stat path_stat;
+        if (fstat(fd, &fd_stat) == 0 && stat(path, &path_stat) == 0 &&
+            fd_stat.st_ino == path_stat.st_ino && fd_stat.st_dev == path_stat.st_dev) {
+            return fd;
+        }
+        close(fd);
+    }
+}
+
+bool cache_lock_acquire(char *cache_prefix) {
+    if (config.cache_path == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&cache_lock_lock);
+    struct cache_lock *held = find_held(cache_prefix);
+    if (held != NULL) {
+        held->holds++;
+    }
+    pthread_mutex_unlock(&cache_lock_lock);
+    if (held != NULL) {
+        return false;
+    }
+
+    char *path = str_concat(cache_prefix, ".lock");
+
+    bool waited = false;
+    int fd = open_locked(path, LOCK_EX | LOCK_NB);
+    if (fd == -1 && errno == EWOULDBLOCK) {
+        waited = true;
+        if (config.verbose) {
+            fprintf(stderr, "Waiting for another process to compile %s\n", cache_prefix);
+        }
+
+        struct timespec poll = {0, CACHE_LOCK_POLL_MS * 1000000L};
+        time_t deadline = time(NULL) + CACHE_LOCK_TIMEOUT;
+        while (fd == -1 && errno == EWOULDBLOCK && time(NULL) < deadline) {
+            nanosleep(&poll, NULL);
+            fd = open_locked(path, LOCK_EX | LOCK_NB);
+        }
+    }
+
+    free(path);
+
+    if (fd == -1) {
+        return waited;
+    }
+
+    struct cache_lock *lock = malloc(sizeof(struct cache_lock));
+    lock->cache_prefix = strdup(cache_prefix);
+    lock->fd = fd;
+    lock->holds = 1;
+
+    pthread_mutex_lock(&cache_lock_lock);
+    lock->next = held_locks;
+    held_locks = lock;
+    pthread_mutex_unlock(&cache_lock_lock);
+
+    return waited;
+}
+
+void cache_lock_release(char *cache_prefix) {
+    struct cache_lock *released = NULL;
+
+    pthread_mutex_lock(&cache_lock_lock);
+    for (struct cache_lock **lock = &held_locks; *lock != NULL; lock = &(*lock)->next) {
+        if (strcmp((*lock)->cache_prefix, cache_prefix) == 0) {
+            if (--(*lock)->holds == 0) {
+                released = *lock;
+                *lock = released->next;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock_lock);
+
+    if (released != NULL) {
+        // Closing the last descriptor for the open file releases the lock
+        close(released->fd);
+        free(released->cache_prefix);
+        free(released);
+    }
+}
+
+int cache_lock_try(char *cache_prefix) {
+    char *path = str_concat(cache_prefix, ".lock");
+    int fd = open_locked(path, LOCK_EX | LOCK_NB);
+    free(path);
+    return fd;
+}
+
+int cache_lock_file(char *name) {
+    if (config.cache_path == NULL) {
+        return -1;
+    }
+
+    char *path = str_concat(config.cache_path, "/");
+    char *lock_path = str_concat(path, name);
+    free(path);
+
+    int fd = open_locked(lock_path, LOCK_EX);
+    free(lock_path);
+    return fd;
+}
@@ -0,0 +1,22 @@
+// Coordinates Planck processes sharing a cache directory, so that only one
+// of them compiles a given namespace at a time
+
+#include <stdbool.h>
+
+// Takes the lock for cache_prefix, waiting (for a bounded time) while
+// another process holds it. Returns true if it had to wait, in which case
+// the other process has likely just cached what the caller was about to
+// compile. The lock is reentrant within a process.
+bool cache_lock_acquire(char *cache_prefix);
+
+// Releases a lock taken by cache_lock_acquire, if it is held
+void cache_lock_release(char *cache_prefix);
+
+// Takes the lock for cache_prefix if no process holds it, without waiting.
+// Returns a descriptor to close to release the lock, or -1.
+int cache_lock_try(char *cache_prefix);
+
+// Opens the file name in the cache directory, creating it if need be, and
+// waits for an exclusive lock on it. Returns a descriptor to close to
+// release the lock, or -1.
+int cache_lock_file(char *name);
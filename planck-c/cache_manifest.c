@@ -0,0 +1,460 @@
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cache_lock.h"
+#include "cache_manifest.h"
+#include "globals.h"
+#include "str.h"
+
+// The manifest is the file manifest.bin in the cache directory: a header
+// (magic and version, uint32_t each) followed by records of
+//
+//   source hash, build hash (uint64_t each), name length, whether present
+//   (uint32_t each), name (not NUL-terminated)
+//
+// in native byte order, the cache being local to the machine. Names are
+// cache prefixes relative to the cache directory, and the last record for a
+// name wins. The manifest is read on first use into a hash table, and then
+// read again, from where it was left off, whenever it has grown.
+//
+// Changes are applied to the table straight away, but written in batches
+// (see cache_manifest_flush), appended in a single write. As other Planck
+// processes may share the cache directory, that is done under a lock on the
+// file manifest.lock, reading what they have appended first. Once there
+// are many more records than entries (or a write was cut short), the
+// manifest is instead compacted: written afresh to a temporary file that is
+// renamed into place, which others notice as a change of inode.
+
+#define MANIFEST_MAGIC 0x4d4b4c50 // "PLKM"
+#define MANIFEST_VERSION 2
+#define MANIFEST_NAME "manifest.bin"
+#define MANIFEST_LOCK_NAME "manifest.lock"
+
+// Compact once records outnumber entries by this factor (and this many)
+#define MANIFEST_COMPACT_FACTOR 2
+#define MANIFEST_COMPACT_MIN 1024
+
+struct manifest_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct manifest_record {
+    uint64_t source_hash;
+    uint64_t build_hash;
+    uint32_t name_len;
+    uint32_t present;
+};
+
+struct manifest_entry {
+    char *name;
+    uint64_t source_hash;
+    uint64_t build_hash;
+    bool present;
+};
+
+static pthread_mutex_t manifest_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool manifest_loaded = false;
+
+// The file as last read: its identity, how far it has been read (the end
+// of the last whole record), and how many records that is
+static dev_t manifest_dev = 0;
+static ino_t manifest_ino = 0;
+static off_t manifest_offset = 0;
+static size_t manifest_num_records = 0;
+
+static struct manifest_entry *manifest_table = NULL;
+static size_t manifest_capacity = 0;
+static size_t manifest_count = 0;
+static size_t manifest_num_present = 0;
+
+// Changes not yet written, in the order made
+static struct manifest_entry *manifest_pending = NULL;
+static size_t manifest_pending_capacity = 0;
+static size_t manifest_num_pending = 0;
+
+static char *manifest_path() {
+    return str_concat(config.cache_path, "/" MANIFEST_NAME);
+}
+
+// The name of cache_prefix relative to the cache directory, or NULL if it
+// is elsewhere (in the shared cache, whose names are content hashes)
+static char *manifest_name(char *cache_prefix) {
+    size_t len = strlen(config.cache_path);
+    if (strncmp(cache_prefix, config.cache_path, len) == 0 && cache_prefix[len] == '/') {
+        return cache_prefix + len + 1;
+    }
+    return NULL;
+}
+
+static struct manifest_entry *manifest_slot(struct manifest_entry *table, size_t capacity, const char *name) {
+    size_t mask = capacity - 1;
+    size_t i = str_hash(name) & mask;
+    while (table[i].name != NULL && strcmp(table[i].name, name) != 0) {
+        i = (i + 1) & mask;
+    }
+    return &table[i];
+}
+
+static struct manifest_entry *manifest_find(const char *name) {
+    if (manifest_count == 0) {
+        return NULL;
+    }
+    struct manifest_entry *slot = manifest_slot(manifest_table, manifest_capacity, name);
+    return slot->name != NULL && slot->present ? slot : NULL;
+}
+
+static void manifest_set(const char *name, uint64_t source_hash, uint64_t build_hash, bool present) {
+    // Keep the load factor under 1/2
+    if (2 * (manifest_count + 1) > manifest_capacity) {
+        size_t capacity = manifest_capacity == 0 ? 256 : 2 * manifest_capacity;
+        struct manifest_entry *table = calloc(capacity, sizeof(struct manifest_entry));
+        for (size_t i = 0; i < manifest_capacity; i++) {
+            if (manifest_table[i].name != NULL) {
+                *manifest_slot(table, capacity, manifest_table[i].name) = manifest_table[i];
+            }
+        }
+        free(manifest_table);
+        manifest_table = table;
+        manifest_capacity = capacity;
+    }
+
+    struct manifest_entry *slot = manifest_slot(manifest_table, manifest_capacity, name);
+    if (slot->name == NULL) {
+        slot->name = strdup(name);
+        manifest_count++;
+    }
+    if (slot->present) {
+        manifest_num_present--;
+    }
+    slot->source_hash = source_hash;
+    slot->build_hash = build_hash;
+    slot->present = present;
+    if (present) {
+        manifest_num_present++;
+    }
+}
+
+static void manifest_clear() {
+    for (size_t i = 0; i < manifest_capacity; i++) {
+        free(manifest_table[i].name);
+    }
+    free(manifest_table);
+    manifest_table = NULL;
+    manifest_capacity = 0;
+    manifest_count = 0;
+    manifest_num_present = 0;
+
+    manifest_dev = 0;
+    manifest_ino = 0;
+    manifest_offset = 0;
+    manifest_num_records = 0;
+}
+
+// Makes a change, to be written by the next flush. Called with
+// manifest_lock held.
+static void manifest_change(const char *name, uint64_t source_hash, uint64_t build_hash, bool present) {
+    manifest_set(name, source_hash, build_hash, present);
+
+    if (manifest_num_pending == manifest_pending_capacity) {
+        manifest_pending_capacity = manifest_pending_capacity == 0 ? 64 : 2 * manifest_pending_capacity;
+        manifest_pending = realloc(manifest_pending, manifest_pending_capacity * sizeof(struct manifest_entry));
+    }
+    struct manifest_entry *change = &manifest_pending[manifest_num_pending++];
+    change->name = strdup(name);
+    change->source_hash = source_hash;
+    change->build_hash = build_hash;
+    change->present = present;
+}
+
+// Applies the changes not yet written over what has been read, as they
+// were made later. Called with manifest_lock held.
+static void manifest_apply_pending() {
+    for (size_t i = 0; i < manifest_num_pending; i++) {
+        struct manifest_entry *change = &manifest_pending[i];
+        manifest_set(change->name, change->source_hash, change->build_hash, change->present);
+    }
+}
+
+// Reads the records from manifest_offset on. Called with manifest_lock held.
+static void manifest_read_records(FILE *f) {
+    if (fseeko(f, manifest_offset, SEEK_SET) != 0) {
+        return;
+    }
+
+    char *name = NULL;
+    for (;;) {
+        struct manifest_record record;
+        if (fread(&record, sizeof(record), 1, f) != 1 || record.name_len > PATH_MAX) {
+            break;
+        }
+        name = realloc(name, record.name_len + 1);
+        if (fread(name, 1, record.name_len, f) != record.name_len) {
+            break;
+        }
+        name[record.name_len] = '\0';
+        manifest_set(name, record.source_hash, record.build_hash, record.present != 0);
+        manifest_offset += sizeof(record) + record.name_len;
+        manifest_num_records++;
+    }
+    free(name);
+}
+
+// Brings the table up to date with the manifest, reading it afresh if it
+// has been replaced (or was never read), and otherwise reading what has
+// been appended since it was last read. Called with manifest_lock held.
+static void manifest_refresh() {
+    char *path = manifest_path();
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        free(path);
+        if (!manifest_loaded || manifest_ino != 0) {
+            manifest_clear();
+            manifest_apply_pending();
+        }
+        manifest_loaded = true;
+        return;
+    }
+
+    bool replaced = !manifest_loaded || st.st_ino != manifest_ino || st.st_dev != manifest_dev ||
+                    st.st_size < manifest_offset;
+    // Past an unreadable header there is nothing to read until it's replaced
+    if (!replaced && (st.st_size == manifest_offset || manifest_offset == 0)) {
+        free(path);
+        return;
+    }
+
+    FILE *f = fopen(path, "rb");
+    free(path);
+    if (f == NULL) {
+        return;
+    }
+
+    if (replaced) {
+        manifest_clear();
+        manifest_dev = st.st_dev;
+        manifest_ino = st.st_ino;
+
+        struct manifest_header header;
+        if (fread(&header, sizeof(header), 1, f) == 1 &&
+            header.magic == MANIFEST_MAGIC && header.version == MANIFEST_VERSION) {
+            manifest_offset = sizeof(header);
+            manifest_read_records(f);
+        }
+    } else {
+        manifest_read_records(f);
+    }
+    manifest_loaded = true;
+
+    fclose(f);
+
+    // What others wrote is older than the changes not yet written here
+    manifest_apply_pending();
+}
+
+static bool write_record(FILE *f, struct manifest_entry *entry) {
+    struct manifest_record record = {entry->source_hash, entry->build_hash, (uint32_t) strlen(entry->name),
+                                     entry->present};
+    return fwrite(&record, sizeof(record), 1, f) == 1 &&
+           fwrite(entry->name, 1, record.name_len, f) == record.name_len;
+}
+
+// Writes the present entries to a new manifest that replaces the old.
+// Called with manifest_lock held, and the manifest lock file locked.
+static void manifest_compact() {
+    char *path = manifest_path();
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, (int) getpid());
+
+    FILE *f = fopen(tmp_path, "wb");
+    if (f == NULL) {
+        free(path);
+        return;
+    }
+
+    struct manifest_header header = {MANIFEST_MAGIC, MANIFEST_VERSION};
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    for (size_t i = 0; ok && i < manifest_capacity; i++) {
+        struct manifest_entry *entry = &manifest_table[i];
+        if (entry->name != NULL && entry->present) {
+            ok = write_record(f, entry);
+        }
+    }
+
+    if (fclose(f) != 0 || !ok || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+    } else {
+        // Read back (which is only the header) to take in the new identity
+        manifest_loaded = false;
+        manifest_refresh();
+    }
+
+    free(path);
+}
+
+// Appends the pending changes, returning false if that wasn't possible.
+// Called with manifest_lock held, and the manifest lock file locked.
+static bool manifest_append() {
+    char *path = manifest_path();
+    FILE *f = fopen(path, "ab");
+    free(path);
+    if (f == NULL) {
+        return false;
+    }
+
+    // Buffered, so that the records go in a single write
+    size_t size = 0;
+    for (size_t i = 0; i < manifest_num_pending; i++) {
+        size += sizeof(struct manifest_record) + strlen(manifest_pending[i].name);
+    }
+    setvbuf(f, NULL, _IOFBF, size + 1);
+
+    bool ok = true;
+    for (size_t i = 0; ok && i < manifest_num_pending; i++) {
+        ok = write_record(f, &manifest_pending[i]);
+    }
+    if (fclose(f) != 0) {
+        ok = false;
+    }
+
+    // Take in what was appended, so that it isn't mistaken for another's
+    manifest_refresh();
+    return ok;
+}
+
+bool cache_manifest_valid(char *cache_prefix, unsigned long long source_hash, char *build_key) {
+    if (config.cache_path == NULL || manifest_name(cache_prefix) == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&manifest_lock);
+
+    manifest_refresh();
+
+    struct manifest_entry *entry = manifest_find(manifest_name(cache_prefix));
+    bool valid = entry != NULL && entry->source_hash == source_hash && entry->build_hash == str_hash64(build_key);
+
+    pthread_mutex_unlock(&manifest_lock);
+
+    return valid;
+}
+
+bool cache_manifest_has(char *cache_prefix) {
+    if (config.cache_path == NULL || manifest_name(cache_prefix) == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&manifest_lock);
+
+    manifest_refresh();
+    bool has = manifest_find(manifest_name(cache_prefix)) != NULL;
+
+    pthread_mutex_unlock(&manifest_lock);
+
+    return has;
+}
+
+void cache_manifest_put(char *cache_prefix, unsigned long long source_hash, char *build_key) {
+    if (config.cache_path == NULL || manifest_name(cache_prefix) == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&manifest_lock);
+
+    if (!manifest_loaded) {
+        manifest_refresh();
+    }
+    manifest_change(manifest_name(cache_prefix), source_hash, str_hash64(build_key), true);
+
+    pthread_mutex_unlock(&manifest_lock);
+}
+
+bool cache_manifest_remove(char *cache_prefix) {
+    if (config.cache_path == NULL || manifest_name(cache_prefix) == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&manifest_lock);
+
+    manifest_refresh();
+
+    char *name = manifest_name(cache_prefix);
+    bool removed = manifest_find(name) != NULL;
+    if (removed) {
+        manifest_change(name, 0, 0, false);
+    }
+
+    pthread_mutex_unlock(&manifest_lock);
+
+    return removed;
+}
+
+void cache_manifest_flush(void) {
+    pthread_mutex_lock(&manifest_lock);
+
+    if (manifest_num_pending == 0) {
+        pthread_mutex_unlock(&manifest_lock);
+        return;
+    }
+
+    int lock_fd = cache_lock_file(MANIFEST_LOCK_NAME);
+
+    manifest_refresh();
+
+    // A manifest that is missing, unreadable, or ends in part of a record
+    // (a write having been cut short) is rewritten rather than appended to
+    char *path = manifest_path();
+    struct stat st;
+    bool intact = stat(path, &st) == 0 && manifest_ino != 0 && st.st_size == manifest_offset;
+    free(path);
+
+    size_t num_records = manifest_num_records + manifest_num_pending;
+    bool bloated = num_records > MANIFEST_COMPACT_MIN &&
+                   num_records > MANIFEST_COMPACT_FACTOR * manifest_num_present;
+
+    if (!intact || bloated || !manifest_append()) {
+        manifest_compact();
+    }
+
+    for (size_t i = 0; i < manifest_num_pending; i++) {
+        free(manifest_pending[i].name);
+    }
+    manifest_num_pending = 0;
+
+    if (lock_fd != -1) {
+        close(lock_fd);
+    }
+    pthread_mutex_unlock(&manifest_lock);
+}
+
+void cache_manifest_prune(void) {
+    if (config.cache_path == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&manifest_lock);
+
+    manifest_refresh();
+
+    for (size_t i = 0; i < manifest_capacity; i++) {
+        struct manifest_entry *entry = &manifest_table[i];
+        if (entry->name != NULL && entry->present) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s.js", config.cache_path, entry->name);
+            if (access(path, F_OK) != 0) {
+                manifest_change(entry->name, 0, 0, false);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&manifest_lock);
+
+    cache_manifest_flush();
+}
@@ -0,0 +1,33 @@
+// A manifest of the compiled artifacts in the cache directory, recording for
+// each the content hash of the source it was compiled from and a hash of the
+// options (compiler version and build-affecting options) it was compiled
+// with, so that whether a cached namespace is current can be decided without
+// reading it
+
+#include <stdbool.h>
+
+// Whether the artifacts at cache_prefix (a path in the cache directory, less
+// extension) were compiled from a source having source_hash, with build_key
+bool cache_manifest_valid(char *cache_prefix, unsigned long long source_hash, char *build_key);
+
+// Whether there is an entry for the artifacts at cache_prefix, however they
+// were compiled
+bool cache_manifest_has(char *cache_prefix);
+
+// Records the artifacts at cache_prefix as compiled from a source having
+// source_hash, with build_key. Like cache_manifest_remove, this is seen by
+// this process at once, but only written by the next cache_manifest_flush.
+void cache_manifest_put(char *cache_prefix, unsigned long long source_hash, char *build_key);
+
+// Forgets the artifacts at cache_prefix, as they are about to be replaced
+// (or were written without a source hash), returning whether there was an
+// entry for them
+bool cache_manifest_remove(char *cache_prefix);
+
+// Writes the changes made since the last flush, appending them to the
+// manifest (or compacting it, once mostly superseded records)
+void cache_manifest_flush(void);
+
+// Forgets the artifacts whose compiled JS is no longer in the cache
+// directory, as after pruning
+void cache_manifest_prune(void);
@@ -0,0 +1,473 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache_pack.h"
+#include "globals.h"
+#include "str.h"
+
+// The pack is the file cache.pack in the cache directory: a header followed
+// by records, each a record header, the name of the artifact (its path
+// relative to the cache directory, not NUL-terminated) and its contents
+// (NUL-terminated, so they can be handed to JSC in place), padded to a
+// multiple of 8 bytes. Records are only ever appended, a later record for
+// a name superseding earlier ones; an index of the latest is built by
+// walking the record headers in the mapped pack when it is first used, and
+// extended as the pack grows. Once superseded records take up more of the
+// pack than live ones, it is compacted by copying the live records to a new
+// pack that replaces it.
+//
+// Other Planck processes may append to the same pack. Each record is
+// appended with a single write, and a record that is incomplete (being
+// written, or torn by a crash) ends the walk; it is retried on the next
+// miss, and dropped by the next compaction. Appends hold a shared flock(2)
+// lock on the pack and compaction an exclusive one, so that no record is
+// appended to a pack after it has been copied.
+
+#define PACK_NAME "cache.pack"
+#define PACK_MAGIC "PLNKPACK"
+#define PACK_MAGIC_LEN 8
+#define PACK_VERSION 1
+#define PACK_RECORD_MAGIC 0x52434b50 // "PKCR"
+
+// Superseded records must take up at least this much before compacting
+#define PACK_COMPACT_MIN (1024 * 1024)
+
+struct pack_header {
+    char magic[PACK_MAGIC_LEN];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct pack_record {
+    uint32_t magic;
+    uint32_t name_len;
+    uint32_t data_len;
+    uint32_t reserved;
+    int64_t mtime;
+};
+
+struct pack_mapping {
+    char *addr;
+    size_t size;
+    int refs;
+    bool current;
+};
+
+struct pack_entry {
+    char *name;
+    uint64_t offset;
+    uint32_t data_len;
+    int64_t mtime;
+};
+
+static pthread_mutex_t pack_lock = PTHREAD_MUTEX_INITIALIZER;
+static int pack_fd = -1;
+static ino_t pack_ino = 0;
+static uint64_t pack_scanned = 0;
+static uint64_t pack_live = 0;
+static struct pack_mapping *pack_map = NULL;
+
+static struct pack_entry *pack_table = NULL;
+static size_t pack_capacity = 0;
+static size_t pack_count = 0;
+
+static size_t pack_record_size(uint32_t name_len, uint32_t data_len) {
+    return (sizeof(struct pack_record) + name_len + data_len + 7) & ~(size_t) 7;
+}
+
+static char *pack_path() {
+    return str_concat(config.cache_path, "/" PACK_NAME);
+}
+
+// The name of path relative to the cache directory, or NULL if it isn't in
+// the cache directory
+static char *pack_name(char *path) {
+    if (config.cache_path == NULL) {
+        return NULL;
+    }
+    size_t len = strlen(config.cache_path);
+    if (strncmp(path, config.cache_path, len) == 0 && path[len] == '/') {
+        return path + len + 1;
+    }
+    return NULL;
+}
+
+static struct pack_entry *pack_slot(struct pack_entry *table, size_t capacity, const char *name, size_t name_len) {
+    size_t mask = capacity - 1;
+    // FNV-1a, as str_hash, but over a name that isn't NUL-terminated
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < name_len; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+    size_t i = hash & mask;
+    while (table[i].name != NULL &&
+           (strncmp(table[i].name, name, name_len) != 0 || table[i].name[name_len] != '\0')) {
+        i = (i + 1) & mask;
+    }
+    return &table[i];
+}
+
+static struct pack_entry *pack_find(const char *name) {
+    if (pack_count == 0) {
+        return NULL;
+    }
+    struct pack_entry *slot = pack_slot(pack_table, pack_capacity, name, strlen(name));
+    return slot->name != NULL ? slot : NULL;
+}
+
+static void pack_index(const char *name, size_t name_len, uint64_t offset, uint32_t data_len, int64_t mtime) {
+    // Keep the load factor under 1/2
+    if (2 * (pack_count + 1) > pack_capacity) {
+        size_t capacity = pack_capacity == 0 ? 1024 : 2 * pack_capacity;
+        struct pack_entry *table = calloc(capacity, sizeof(struct pack_entry));
+        for (size_t i = 0; i < pack_capacity; i++) {
+            if (pack_table[i].name != NULL) {
+                *pack_slot(table, capacity, pack_table[i].name, strlen(pack_table[i].name)) = pack_table[i];
+            }
+        }
+        free(pack_table);
+        pack_table = table;
+        pack_capacity = capacity;
+    }
+
+    struct pack_entry *slot = pack_slot(pack_table, pack_capacity, name, name_len);
+    if (slot->name == NULL) {
+        slot->name = strndup(name, name_len);
+        pack_count++;
+    } else {
+        pack_live -= pack_record_size((uint32_t) name_len, slot->data_len);
+    }
+    slot->offset = offset;
+    slot->data_len = data_len;
+    slot->mtime = mtime;
+    pack_live += pack_record_size((uint32_t) name_len, data_len);
+}
+
+static void pack_unmap(struct pack_mapping *mapping) {
+    munmap(mapping->addr, mapping->size);
+    free(mapping);
+}
+
+// Maps the whole pack, if it has grown beyond the current mapping
+static bool pack_remap(size_t size) {
+    if (pack_map != NULL && pack_map->size >= size) {
+        return true;
+    }
+
+    void *addr = mmap(NULL, size, PROT_READ, MAP_SHARED, pack_fd, 0);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+
+    if (pack_map != NULL) {
+        pack_map->current = false;
+        if (pack_map->refs == 0) {
+            pack_unmap(pack_map);
+        }
+    }
+
+    pack_map = malloc(sizeof(struct pack_mapping));
+    pack_map->addr = addr;
+    pack_map->size = size;
+    pack_map->refs = 0;
+    pack_map->current = true;
+
+    return true;
+}
+
+// Maps the whole pack, indexing the records appended since the last scan
+static void pack_scan() {
+    struct stat st;
+    if (fstat(pack_fd, &st) != 0 || st.st_size <= 0 || !pack_remap(st.st_size)) {
+        return;
+    }
+    uint64_t file_size = (uint64_t) st.st_size;
+
+    uint64_t offset = pack_scanned;
+    while (offset + sizeof(struct pack_record) <= file_size) {
+        struct pack_record *record = (struct pack_record *) (pack_map->addr + offset);
+        if (record->magic != PACK_RECORD_MAGIC || record->name_len > PATH_MAX || record->data_len == 0) {
+            break;
+        }
+        size_t size = pack_record_size(record->name_len, record->data_len);
+        if (offset + size > file_size ||
+            pack_map->addr[offset + sizeof(struct pack_record) + record->name_len + record->data_len - 1] != '\0') {
+            break;
+        }
+        pack_index(pack_map->addr + offset + sizeof(struct pack_record), record->name_len,
+                   offset, record->data_len, record->mtime);
+        offset += size;
+    }
+    pack_scanned = offset;
+}
+
+static void pack_close() {
+    if (pack_fd >= 0) {
+        close(pack_fd);
+        pack_fd = -1;
+    }
+
+    if (pack_map != NULL) {
+        pack_map->current = false;
+        if (pack_map->refs == 0) {
+            pack_unmap(pack_map);
+        }
+        pack_map = NULL;
+    }
+
+    for (size_t i = 0; i < pack_capacity; i++) {
+        free(pack_table[i].name);
+    }
+    free(pack_table);
+    pack_table = NULL;
+    pack_capacity = 0;
+    pack_count = 0;
+    pack_live = 0;
+    pack_scanned = 0;
+}
+
+// Opens the pack, creating it if need be, and indexes it
+static bool pack_open() {
+    char *path = pack_path();
+    pack_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    free(path);
+    if (pack_fd < 0) {
+        return false;
+    }
+
+    // Write the header (replacing a pack in an older format) under a lock,
+    // so that it is only written once
+    flock(pack_fd, LOCK_EX);
+    struct stat st;
+    struct pack_header header;
+    bool valid = fstat(pack_fd, &st) == 0 && st.st_size >= (off_t) sizeof(header) &&
+                 pread(pack_fd, &header, sizeof(header), 0) == sizeof(header) &&
+                 memcmp(header.magic, PACK_MAGIC, PACK_MAGIC_LEN) == 0 && header.version == PACK_VERSION;
+    if (!valid) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, PACK_MAGIC, PACK_MAGIC_LEN);
+        header.version = PACK_VERSION;
+        valid = ftruncate(pack_fd, 0) == 0 && write(pack_fd, &header, sizeof(header)) == sizeof(header);
+    }
+    flock(pack_fd, LOCK_UN);
+
+    if (!valid || fstat(pack_fd, &st) != 0) {
+        pack_close();
+        return false;
+    }
+    pack_ino = st.st_ino;
+
+    pack_scanned = sizeof(struct pack_header);
+    pack_scan();
+
+    return true;
+}
+
+// Opens the pack, or reopens it if it has been replaced (compacted by
+// another process) since it was opened
+static bool pack_ensure_open() {
+    if (pack_fd >= 0) {
+        char *path = pack_path();
+        struct stat st;
+        bool replaced = stat(path, &st) != 0 || st.st_ino != pack_ino;
+        free(path);
+        if (!replaced) {
+            return true;
+        }
+        pack_close();
+    }
+
+    return pack_open();
+}
+
+// Takes a lock on the pack, reopening it first if it has been replaced
+// while waiting for the lock
+static bool pack_lock_current(int operation) {
+    for (int attempt = 0; attempt < 3; attempt++) {
+        if (!pack_ensure_open()) {
+            return false;
+        }
+        if (flock(pack_fd, operation) != 0) {
+            return false;
+        }
+        char *path = pack_path();
+        struct stat st;
+        bool replaced = stat(path, &st) != 0 || st.st_ino != pack_ino;
+        free(path);
+        if (!replaced) {
+            return true;
+        }
+        flock(pack_fd, LOCK_UN);
+    }
+    return false;
+}
+
+static void pack_compact() {
+    if (!pack_lock_current(LOCK_EX)) {
+        return;
+    }
+
+    // Index what other processes have appended
+    pack_scan();
+    if (pack_map == NULL) {
+        flock(pack_fd, LOCK_UN);
+        return;
+    }
+
+    char *path = pack_path();
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, (int) getpid());
+
+    FILE *f = fopen(tmp_path, "wb");
+    if (f == NULL) {
+        flock(pack_fd, LOCK_UN);
+        free(path);
+        return;
+    }
+
+    struct pack_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACK_MAGIC, PACK_MAGIC_LEN);
+    header.version = PACK_VERSION;
+
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    for (size_t i = 0; ok && i < pack_capacity; i++) {
+        struct pack_entry *entry = &pack_table[i];
+        if (entry->name != NULL) {
+            size_t size = pack_record_size((uint32_t) strlen(entry->name), entry->data_len);
+            if (entry->offset + size <= pack_map->size) {
+                ok = fwrite(pack_map->addr + entry->offset, 1, size, f) == size;
+            }
+        }
+    }
+
+    if (fclose(f) != 0 || !ok || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        flock(pack_fd, LOCK_UN);
+    } else {
+        // Closing the replaced pack releases the lock
+        pack_close();
+        pack_open();
+        if (config.verbose) {
+            fprintf(stderr, "Compacted cache pack to %zu entries\n", pack_count);
+        }
+    }
+
+    free(path);
+}
+
+bool cache_pack_owns(char *path) {
+    // Only artifacts: the manifest, lock files and the pack itself stay files
+    return config.cache_pack && pack_name(path) != NULL &&
+           (str_has_suffix(path, ".js") == 0 || str_has_suffix(path, ".cache.json") == 0 ||
+            str_has_suffix(path, ".js.map.json") == 0);
+}
+
+char *cache_pack_get(char *path, time_t *last_modified, void **handle) {
+    char *name = pack_name(path);
+    if (name == NULL) {
+        return NULL;
+    }
+
+    char *contents = NULL;
+
+    pthread_mutex_lock(&pack_lock);
+
+    if (pack_fd >= 0 || pack_open()) {
+        struct pack_entry *entry = pack_find(name);
+        if (entry == NULL && pack_ensure_open()) {
+            pack_scan();
+            entry = pack_find(name);
+        }
+
+        if (entry != NULL) {
+            // Records appended by this process are indexed without being mapped
+            size_t size = pack_record_size((uint32_t) strlen(name), entry->data_len);
+            struct stat st;
+            if ((pack_map == NULL || entry->offset + size > pack_map->size) && fstat(pack_fd, &st) == 0) {
+                pack_remap(st.st_size);
+            }
+            if (pack_map != NULL && entry->offset + size <= pack_map->size) {
+                contents = pack_map->addr + entry->offset + sizeof(struct pack_record) + strlen(name);
+                if (last_modified != NULL) {
+                    *last_modified = entry->mtime;
+                }
+                pack_map->refs++;
+                *handle = pack_map;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&pack_lock);
+
+    return contents;
+}
+
+void cache_pack_release(void *handle) {
+    struct pack_mapping *mapping = handle;
+
+    pthread_mutex_lock(&pack_lock);
+    mapping->refs--;
+    if (mapping->refs == 0 && !mapping->current) {
+        pack_unmap(mapping);
+    }
+    pthread_mutex_unlock(&pack_lock);
+}
+
+void cache_pack_put(char *path, char *contents) {
+    char *name = pack_name(path);
+    if (name == NULL) {
+        return;
+    }
+
+    size_t name_len = strlen(name);
+    size_t data_len = strlen(contents) + 1;
+    size_t size = pack_record_size((uint32_t) name_len, (uint32_t) data_len);
+
+    char *buf = calloc(1, size);
+    struct pack_record *record = (struct pack_record *) buf;
+    record->magic = PACK_RECORD_MAGIC;
+    record->name_len = (uint32_t) name_len;
+    record->data_len = (uint32_t) data_len;
+    record->mtime = time(NULL);
+    memcpy(buf + sizeof(struct pack_record), name, name_len);
+    memcpy(buf + sizeof(struct pack_record) + name_len, contents, data_len);
+
+    pthread_mutex_lock(&pack_lock);
+
+    if (pack_lock_current(LOCK_SH)) {
+        // A single write, so that the record isn't interleaved with those
+        // appended by other processes
+        ssize_t written = write(pack_fd, buf, size);
+        off_t end = lseek(pack_fd, 0, SEEK_CUR);
+        flock(pack_fd, LOCK_UN);
+        if (written >= 0 && (size_t) written == size && end >= 0 && (uint64_t) end >= size) {
+            uint64_t offset = (uint64_t) end - size;
+            if (offset == pack_scanned) {
+                pack_scanned = end;
+            }
+            pack_index(name, name_len, offset, (uint32_t) data_len, record->mtime);
+
+            uint64_t dead = end - sizeof(struct pack_header) - pack_live;
+            if (dead > pack_live && dead > PACK_COMPACT_MIN) {
+                pack_compact();
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&pack_lock);
+
+    free(buf);
+}
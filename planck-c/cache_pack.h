@@ -0,0 +1,21 @@
+// A pack file holding the whole compilation cache, as an alternative to a
+// file per artifact in the cache directory (see --cache-pack)
+
+#include <stdbool.h>
+#include <time.h>
+
+// Whether path is a cache directory path that is stored in the pack, which
+// is the case for compiled artifacts (.js, .cache.json and .js.map.json
+// files, including the deps.cljs cache) when the pack is in use
+bool cache_pack_owns(char *path);
+
+// Returns the contents stored for path (NUL-terminated, and mapped from the
+// pack rather than copied), or NULL if there are none, setting
+// last_modified to when they were stored. The contents remain valid until
+// handle is passed to cache_pack_release.
+char *cache_pack_get(char *path, time_t *last_modified, void **handle);
+
+void cache_pack_release(void *handle);
+
+// Stores contents for path, superseding any stored before
+void cache_pack_put(char *path, char *contents);
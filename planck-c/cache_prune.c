@@ -0,0 +1,373 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cache_lock.h"
+#include "cache_manifest.h"
+#include "cache_prune.h"
+#include "globals.h"
+#include "str.h"
+
+// An entry is the set of files sharing a cache prefix: the compiled JS,
+// analysis cache, source map and lock file. It was last used when the most
+// recently used of these was. As atime is not kept current on many
+// filesystems (noatime, relatime), reads of the cache set it explicitly
+// (see cache_touch).
+//
+// As the cache directory may be one the user also keeps other files in,
+// only entries that are evidently Planck's are ever removed (or counted):
+// those in the manifest, or whose compiled JS starts with the header
+// Planck writes. Files matching the suffixes are otherwise left alone.
+//
+// An entry is only removed while holding its lock, so that one being
+// compiled (or written) by another process is left alone. Its compiled JS
+// goes first, so that the others are never taken to be current without it,
+// and its lock file last, before the lock is let go; a process that opened
+// that lock file meanwhile notices once it gets the lock (see cache_lock.c).
+//
+// Files left behind by writes that were interrupted are removed once they
+// are an hour old, if they were being written for an entry that is
+// Planck's, or for the manifest. The manifest, pack and the like are left
+// alone, the pack having its own compaction.
+
+#define PRUNE_STAMP_NAME "prune.stamp"
+#define PRUNE_INTERVAL (24 * 60 * 60)
+#define PRUNE_TMP_MAX_AGE (60 * 60)
+
+// How compiled JS in the cache starts (see form-compiled-by-string)
+#define PRUNE_JS_HEADER "// Compiled by ClojureScript "
+
+static char *entry_suffixes[] = {".js.map.json", ".cache.json", ".js", ".lock", NULL};
+
+// In the order removed, the JS first
+static char *removal_suffixes[] = {".js", ".cache.json", ".js.map.json", NULL};
+
+static char *kept_names[] = {"manifest.bin", "manifest.lock", "cache.pack", PRUNE_STAMP_NAME, NULL};
+
+struct prune_file {
+    char *key;
+    off_t size;
+    time_t used;
+    // For a temporary file, its name (and key, that of the file being written)
+    char *tmp_name;
+};
+
+struct prune_entry {
+    char *key;
+    unsigned long long size;
+    time_t used;
+};
+
+void cache_touch(char *path) {
+    // Only the access time, as the modification time is what the cache is
+    // validated against
+    struct timespec times[2] = {{0, UTIME_NOW}, {0, UTIME_OMIT}};
+    utimensat(AT_FDCWD, path, times, 0);
+}
+
+static bool is_kept(char *name) {
+    for (char **kept = kept_names; *kept != NULL; kept++) {
+        if (strcmp(name, *kept) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The cache prefix (relative to the cache directory) of the file name, or
+// NULL if it isn't part of an entry
+static char *entry_key(char *name) {
+    for (char **suffix = entry_suffixes; *suffix != NULL; suffix++) {
+        if (str_has_suffix(name, *suffix) == 0 && strlen(name) > strlen(*suffix)) {
+            return strndup(name, strlen(name) - strlen(*suffix));
+        }
+    }
+    return NULL;
+}
+
+// For a temporary file name, written as <name>.<pid>[.<n>].tmp, the key of
+// the entry name belongs to, or the name itself if it is the manifest or
+// pack (which don't belong to entries), or NULL if it is neither
+static char *tmp_key(char *tmp_name) {
+    char *name = strndup(tmp_name, strlen(tmp_name) - strlen(".tmp"));
+    for (int i = 0; i < 2; i++) {
+        char *dot = strrchr(name, '.');
+        if (dot == NULL || dot[1] == '\0' || strspn(dot + 1, "0123456789") != strlen(dot + 1)) {
+            break;
+        }
+        *dot = '\0';
+    }
+
+    char *key = is_kept(name) ? strdup(name) : entry_key(name);
+    free(name);
+    return key;
+}
+
+static int compare_file_keys(const void *a, const void *b) {
+    return strcmp(((struct prune_file *) a)->key, ((struct prune_file *) b)->key);
+}
+
+static int compare_entries_used(const void *a, const void *b) {
+    time_t used_a = ((struct prune_entry *) a)->used;
+    time_t used_b = ((struct prune_entry *) b)->used;
+    return used_a < used_b ? -1 : used_a > used_b ? 1 : 0;
+}
+
+// Lists the files in dir making up entries, and the temporary files over
+// PRUNE_TMP_MAX_AGE old left by writes of them
+static struct prune_file *list_files(char *dir, size_t *count) {
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return NULL;
+    }
+
+    size_t capacity = 256;
+    struct prune_file *files = malloc(capacity * sizeof(struct prune_file));
+    *count = 0;
+
+    time_t now = time(NULL);
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] == '.' || is_kept(ent->d_name)) {
+            continue;
+        }
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        struct stat st;
+        if (lstat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        char *tmp_name = NULL;
+        char *key;
+        if (str_has_suffix(ent->d_name, ".tmp") == 0) {
+            if (now - st.st_mtime <= PRUNE_TMP_MAX_AGE) {
+                continue;
+            }
+            tmp_name = strdup(ent->d_name);
+            key = tmp_key(ent->d_name);
+        } else {
+            key = entry_key(ent->d_name);
+        }
+        if (key == NULL) {
+            free(tmp_name);
+            continue;
+        }
+
+        if (*count == capacity) {
+            capacity *= 2;
+            files = realloc(files, capacity * sizeof(struct prune_file));
+        }
+        files[*count].key = key;
+        files[*count].size = st.st_size;
+        files[*count].used = st.st_atime > st.st_mtime ? st.st_atime : st.st_mtime;
+        files[*count].tmp_name = tmp_name;
+        (*count)++;
+    }
+
+    closedir(d);
+    return files;
+}
+
+// Groups files (sorting them) into entries
+static struct prune_entry *group_files(struct prune_file *files, size_t num_files, size_t *count) {
+    qsort(files, num_files, sizeof(struct prune_file), compare_file_keys);
+
+    struct prune_entry *entries = malloc((num_files + 1) * sizeof(struct prune_entry));
+    *count = 0;
+    for (size_t i = 0; i < num_files; i++) {
+        if (files[i].tmp_name != NULL) {
+            continue;
+        }
+        struct prune_entry *entry = *count > 0 ? &entries[*count - 1] : NULL;
+        if (entry == NULL || strcmp(entry->key, files[i].key) != 0) {
+            entry = &entries[(*count)++];
+            entry->key = files[i].key;
+            entry->size = 0;
+            entry->used = 0;
+        }
+        entry->size += files[i].size;
+        if (files[i].used > entry->used) {
+            entry->used = files[i].used;
+        }
+    }
+    return entries;
+}
+
+// Whether the file at path starts with the header of compiled JS
+static bool has_js_header(char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return false;
+    }
+    char header[sizeof(PRUNE_JS_HEADER)] = {0};
+    bool has = fread(header, 1, sizeof(header) - 1, f) == sizeof(header) - 1 &&
+               strcmp(header, PRUNE_JS_HEADER) == 0;
+    fclose(f);
+    return has;
+}
+
+// Whether the entry with key in dir is evidently Planck's
+static bool is_planck_entry(char *dir, char *key) {
+    char prefix[PATH_MAX];
+    snprintf(prefix, sizeof(prefix), "%s/%s", dir, key);
+    if (cache_manifest_has(prefix)) {
+        return true;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s.js", prefix);
+    return has_js_header(path);
+}
+
+static int compare_entry_key(const void *key, const void *entry) {
+    return strcmp((char *) key, ((struct prune_entry *) entry)->key);
+}
+
+// Removes the temporary files listed that were being written for the
+// manifest or pack, for one of entries (sorted by key), or that are
+// evidently compiled JS
+static void remove_tmp_files(char *dir, struct prune_file *files, size_t num_files,
+                             struct prune_entry *entries, size_t num_entries) {
+    for (size_t i = 0; i < num_files; i++) {
+        if (files[i].tmp_name == NULL) {
+            continue;
+        }
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, files[i].tmp_name);
+        if (is_kept(files[i].key) ||
+            bsearch(files[i].key, entries, num_entries, sizeof(struct prune_entry), compare_entry_key) != NULL ||
+            has_js_header(path)) {
+            unlink(path);
+        }
+    }
+}
+
+static bool remove_entry(char *dir, char *key) {
+    char prefix[PATH_MAX];
+    snprintf(prefix, sizeof(prefix), "%s/%s", dir, key);
+
+    int lock_fd = cache_lock_try(prefix);
+    if (lock_fd == -1) {
+        return false;
+    }
+
+    for (char **suffix = removal_suffixes; *suffix != NULL; suffix++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s%s", prefix, *suffix);
+        unlink(path);
+    }
+
+    char lock_path[PATH_MAX];
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", prefix);
+    unlink(lock_path);
+    close(lock_fd);
+
+    return true;
+}
+
+void cache_prune(char *dir, unsigned long long max_bytes, time_t max_age, bool report) {
+    size_t num_files = 0;
+    struct prune_file *files = list_files(dir, &num_files);
+    if (files == NULL) {
+        if (report) {
+            fprintf(stderr, "Unable to read cache directory %s\n", dir);
+        }
+        return;
+    }
+
+    size_t num_entries = 0;
+    struct prune_entry *entries = group_files(files, num_files, &num_entries);
+
+    // Only Planck's own entries are counted, or removed
+    size_t num_planck = 0;
+    for (size_t i = 0; i < num_entries; i++) {
+        if (is_planck_entry(dir, entries[i].key)) {
+            entries[num_planck++] = entries[i];
+        }
+    }
+    num_entries = num_planck;
+
+    remove_tmp_files(dir, files, num_files, entries, num_entries);
+
+    // Least recently used first
+    qsort(entries, num_entries, sizeof(struct prune_entry), compare_entries_used);
+
+    unsigned long long total = 0;
+    for (size_t i = 0; i < num_entries; i++) {
+        total += entries[i].size;
+    }
+
+    time_t now = time(NULL);
+    size_t removed = 0;
+    unsigned long long removed_bytes = 0;
+    for (size_t i = 0; i < num_entries; i++) {
+        bool expired = max_age > 0 && now - entries[i].used > max_age;
+        bool over = max_bytes > 0 && total - removed_bytes > max_bytes;
+        if (!expired && !over) {
+            break;
+        }
+        if (remove_entry(dir, entries[i].key)) {
+            removed++;
+            removed_bytes += entries[i].size;
+        }
+    }
+
+    if (removed > 0 && config.cache_path != NULL && !config.cache_pack && strcmp(dir, config.cache_path) == 0) {
+        cache_manifest_prune();
+    }
+
+    if (report) {
+        fprintf(stderr, "Pruned %zu of %zu entries (%.1f of %.1f MB) from %s\n", removed, num_entries,
+                removed_bytes / (1024.0 * 1024.0), total / (1024.0 * 1024.0), dir);
+    }
+
+    for (size_t i = 0; i < num_files; i++) {
+        free(files[i].key);
+        free(files[i].tmp_name);
+    }
+    free(files);
+    free(entries);
+}
+
+// Whether dir was last pruned over PRUNE_INTERVAL ago, noting that it is
+// being pruned now if so
+static bool prune_due(char *dir) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, PRUNE_STAMP_NAME);
+
+    struct stat st;
+    if (stat(path, &st) == 0 && time(NULL) - st.st_mtime < PRUNE_INTERVAL) {
+        return false;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return false;
+    }
+    futimens(fd, NULL);
+    close(fd);
+    return true;
+}
+
+void cache_prune_all(bool force) {
+    char *dirs[] = {config.cache_path, config.shared_cache_path};
+    for (int i = 0; i < 2; i++) {
+        if (dirs[i] != NULL && (force || prune_due(dirs[i]))) {
+            cache_prune(dirs[i], config.cache_max_size, config.cache_max_age, force || config.verbose);
+        }
+    }
+}
+
+void cache_prune_if_due(void) {
+    cache_prune_all(false);
+}
@@ -0,0 +1,21 @@
+// Keeps cache directories bounded, by evicting the least recently used
+// entries once they exceed a size, and any unused for too long
+
+#include <stdbool.h>
+#include <time.h>
+
+// Notes that the cache file at path was just used
+void cache_touch(char *path);
+
+// Removes the least recently used of Planck's entries (the files sharing a
+// cache prefix) in the cache directory dir until those remaining take up at
+// most max_bytes, along with any not used in max_age seconds. Either limit
+// may be 0 for none. If report, prints what was removed.
+void cache_prune(char *dir, unsigned long long max_bytes, time_t max_age, bool report);
+
+// Prunes the cache directory and shared cache, if in use, within the limits
+// in config. Unless force, only does so if not done in the last day.
+void cache_prune_all(bool force);
+
+// cache_prune_all(false), for use with atexit
+void cache_prune_if_due(void);
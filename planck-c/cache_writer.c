@@ -0,0 +1,338 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cache_lock.h"
+#include "cache_manifest.h"
+#include "cache_pack.h"
+#include "cache_writer.h"
+#include "io.h"
+#include "str.h"
+
+// A single thread writes queued artifacts in the order they were compiled.
+// Each file is written to a temporary file and renamed into place, so a
+// reader (or another Planck process) never sees one partly written. The
+// manifest entry for a namespace is dropped before its files are replaced
+// and recorded once they all are, so that it never vouches for a mix of old
+// and new files; the .js file, which the mtime-based check keys on, is
+// written last for the same reason. Manifest changes are written in a
+// batch once the queue drains, except that a dropped entry is written at
+// once, before its files are replaced.
+//
+// Until its files are written, a queued namespace is found by its cache
+// prefix in an open-addressed hash table, so that reads of the cache
+// within this process are served what is queued (see cache_writer_get and
+// cache_writer_valid) rather than waiting on the disk. Exit waits for the
+// queue to drain (see cache_writer_flush). Locks taken to compile a
+// namespace (see cache_lock.h) are released through the queue too, so that
+// other processes waiting on them find its files written.
+
+// Beyond this much queued, compilation waits for the writer to catch up
+#define CACHE_WRITER_MAX_BYTES (64 * 1024 * 1024)
+
+struct cache_write {
+    char *cache_prefix;
+    char *source;
+    char *cache;
+    char *sourcemap;
+    char *source_hash;
+    char *build_key;
+    bool unlock;
+    time_t queued;
+    size_t size;
+    struct cache_write *next;
+};
+
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t writer_done = PTHREAD_COND_INITIALIZER;
+static bool writer_started = false;
+static bool writer_busy = false;
+
+static struct cache_write *writer_head = NULL;
+static struct cache_write *writer_tail = NULL;
+static size_t writer_bytes = 0;
+
+// The latest write queued (or being performed) for each cache prefix
+static struct cache_write **pending_table = NULL;
+static size_t pending_capacity = 0;
+static size_t pending_count = 0;
+
+static size_t pending_slot(const char *cache_prefix) {
+    size_t mask = pending_capacity - 1;
+    size_t i = str_hash(cache_prefix) & mask;
+    while (pending_table[i] != NULL && strcmp(pending_table[i]->cache_prefix, cache_prefix) != 0) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// Called with writer_lock held
+static struct cache_write *pending_find(const char *cache_prefix) {
+    if (pending_count == 0) {
+        return NULL;
+    }
+    return pending_table[pending_slot(cache_prefix)];
+}
+
+// Called with writer_lock held
+static void pending_put(struct cache_write *write) {
+    // Keep the load factor under 1/2
+    if (2 * (pending_count + 1) > pending_capacity) {
+        struct cache_write **old_table = pending_table;
+        size_t old_capacity = pending_capacity;
+        pending_capacity = old_capacity == 0 ? 64 : 2 * old_capacity;
+        pending_table = calloc(pending_capacity, sizeof(struct cache_write *));
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old_table[i] != NULL) {
+                pending_table[pending_slot(old_table[i]->cache_prefix)] = old_table[i];
+            }
+        }
+        free(old_table);
+    }
+
+    size_t i = pending_slot(write->cache_prefix);
+    if (pending_table[i] == NULL) {
+        pending_count++;
+    }
+    pending_table[i] = write;
+}
+
+// Removes write, if it is still the latest for its prefix, moving back any
+// writes after it in its run that would otherwise no longer be found.
+// Called with writer_lock held.
+static void pending_remove(struct cache_write *write) {
+    if (pending_find(write->cache_prefix) != write) {
+        return;
+    }
+
+    size_t mask = pending_capacity - 1;
+    size_t i = pending_slot(write->cache_prefix);
+    pending_table[i] = NULL;
+    pending_count--;
+
+    for (size_t j = (i + 1) & mask; pending_table[j] != NULL; j = (j + 1) & mask) {
+        size_t home = str_hash(pending_table[j]->cache_prefix) & mask;
+        // Move the write at j to the hole at i unless its home lies
+        // cyclically in (i, j]
+        bool in_place = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+        if (!in_place) {
+            pending_table[i] = pending_table[j];
+            pending_table[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+static void write_artifact(char *cache_prefix, char *suffix, char *contents) {
+    if (contents == NULL) {
+        return;
+    }
+
+    char *path = str_concat(cache_prefix, suffix);
+    if (cache_pack_owns(path)) {
+        cache_pack_put(path, contents);
+    } else {
+        write_contents_atomic(path, contents);
+    }
+    free(path);
+}
+
+static void perform_write(struct cache_write *write) {
+    if (write->unlock) {
+        // Others waiting on the lock rely on the manifest too
+        cache_manifest_flush();
+        cache_lock_release(write->cache_prefix);
+        return;
+    }
+
+    if (cache_manifest_remove(write->cache_prefix)) {
+        cache_manifest_flush();
+    }
+
+    write_artifact(write->cache_prefix, ".js.map.json", write->sourcemap);
+    write_artifact(write->cache_prefix, ".cache.json", write->cache);
+    write_artifact(write->cache_prefix, ".js", write->source);
+
+    if (write->source_hash != NULL && write->build_key != NULL) {
+        cache_manifest_put(write->cache_prefix, strtoull(write->source_hash, NULL, 16), write->build_key);
+    }
+}
+
+static void free_write(struct cache_write *write) {
+    free(write->cache_prefix);
+    free(write->source);
+    free(write->cache);
+    free(write->sourcemap);
+    free(write->source_hash);
+    free(write->build_key);
+    free(write);
+}
+
+static void *writer_thread(void *data) {
+    pthread_mutex_lock(&writer_lock);
+    for (;;) {
+        while (writer_head == NULL) {
+            pthread_cond_wait(&writer_queued, &writer_lock);
+        }
+
+        struct cache_write *write = writer_head;
+        writer_head = write->next;
+        if (writer_head == NULL) {
+            writer_tail = NULL;
+        }
+        writer_busy = true;
+        pthread_mutex_unlock(&writer_lock);
+
+        perform_write(write);
+
+        pthread_mutex_lock(&writer_lock);
+        // Written, and recorded in the manifest, so no longer served from here
+        if (!write->unlock) {
+            pending_remove(write);
+        }
+        if (writer_head == NULL) {
+            // Drained, so write the manifest before anyone waiting goes on
+            pthread_mutex_unlock(&writer_lock);
+            cache_manifest_flush();
+            pthread_mutex_lock(&writer_lock);
+        }
+        writer_bytes -= write->size;
+        writer_busy = false;
+        free_write(write);
+        pthread_cond_broadcast(&writer_done);
+    }
+    return NULL;
+}
+
+// Called with writer_lock held
+static bool writer_start() {
+    if (!writer_started) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, writer_thread, NULL) != 0) {
+            return false;
+        }
+        pthread_detach(thread);
+        writer_started = true;
+        atexit(cache_writer_flush);
+    }
+    return true;
+}
+
+static size_t length(char *s) {
+    return s != NULL ? strlen(s) : 0;
+}
+
+static void submit(struct cache_write *write) {
+    pthread_mutex_lock(&writer_lock);
+
+    if (!writer_start()) {
+        // Write synchronously instead
+        pthread_mutex_unlock(&writer_lock);
+        perform_write(write);
+        cache_manifest_flush();
+        free_write(write);
+        return;
+    }
+
+    while (writer_bytes > 0 && writer_bytes + write->size > CACHE_WRITER_MAX_BYTES) {
+        pthread_cond_wait(&writer_done, &writer_lock);
+    }
+
+    if (writer_tail != NULL) {
+        writer_tail->next = write;
+    } else {
+        writer_head = write;
+    }
+    writer_tail = write;
+    writer_bytes += write->size;
+    if (!write->unlock) {
+        pending_put(write);
+    }
+    pthread_cond_signal(&writer_queued);
+
+    pthread_mutex_unlock(&writer_lock);
+}
+
+static struct cache_write *make_write(char *cache_prefix, char *source, char *cache, char *sourcemap,
+                                      char *source_hash, char *build_key, bool unlock) {
+    struct cache_write *write = malloc(sizeof(struct cache_write));
+    write->cache_prefix = cache_prefix;
+    write->source = source;
+    write->cache = cache;
+    write->sourcemap = sourcemap;
+    write->source_hash = source_hash;
+    write->build_key = build_key;
+    write->unlock = unlock;
+    write->queued = time(NULL);
+    write->size = length(source) + length(cache) + length(sourcemap);
+    write->next = NULL;
+    return write;
+}
+
+void cache_writer_submit(char *cache_prefix, char *source, char *cache, char *sourcemap,
+                         char *source_hash, char *build_key) {
+    submit(make_write(cache_prefix, source, cache, sourcemap, source_hash, build_key, false));
+}
+
+void cache_writer_unlock(char *cache_prefix) {
+    submit(make_write(cache_prefix, NULL, NULL, NULL, NULL, NULL, true));
+}
+
+void cache_writer_flush(void) {
+    pthread_mutex_lock(&writer_lock);
+    while (writer_head != NULL || writer_busy) {
+        pthread_cond_wait(&writer_done, &writer_lock);
+    }
+    pthread_mutex_unlock(&writer_lock);
+}
+
+char *cache_writer_get(char *path, time_t *last_modified) {
+    static char *suffixes[] = {".js.map.json", ".cache.json", ".js", NULL};
+
+    char *contents = NULL;
+
+    pthread_mutex_lock(&writer_lock);
+
+    for (char **suffix = suffixes; pending_count > 0 && *suffix != NULL; suffix++) {
+        if (str_has_suffix(path, *suffix) == 0) {
+            char *cache_prefix = strndup(path, strlen(path) - strlen(*suffix));
+            struct cache_write *write = pending_find(cache_prefix);
+            free(cache_prefix);
+
+            if (write != NULL) {
+                char *queued = strcmp(*suffix, ".js") == 0 ? write->source :
+                               strcmp(*suffix, ".cache.json") == 0 ? write->cache : write->sourcemap;
+                if (queued != NULL) {
+                    contents = strdup(queued);
+                    *last_modified = write->queued;
+                }
+            }
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&writer_lock);
+
+    return contents;
+}
+
+bool cache_writer_valid(char *cache_prefix, unsigned long long source_hash, char *build_key, bool *queued) {
+    bool valid = false;
+
+    pthread_mutex_lock(&writer_lock);
+
+    struct cache_write *write = pending_find(cache_prefix);
+    *queued = write != NULL;
+    if (write != NULL) {
+        valid = write->source_hash != NULL && write->build_key != NULL &&
+                strtoull(write->source_hash, NULL, 16) == source_hash && strcmp(write->build_key, build_key) == 0;
+    }
+
+    pthread_mutex_unlock(&writer_lock);
+
+    return valid;
+}
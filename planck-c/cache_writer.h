@@ -0,0 +1,30 @@
+// Persists compiled artifacts to the cache on a background thread, so that
+// evaluation doesn't wait on the disk
+
+#include <stdbool.h>
+#include <time.h>
+
+// Queues the artifacts compiled for cache_prefix to be written, taking
+// ownership of the strings. cache and sourcemap may be NULL, as may
+// source_hash and build_key, in which case the manifest entry for
+// cache_prefix is dropped rather than recorded.
+void cache_writer_submit(char *cache_prefix, char *source, char *cache, char *sourcemap,
+                         char *source_hash, char *build_key);
+
+// Queues the release of the cache lock for cache_prefix, taking ownership
+// of the string, so that it is released once what was queued before has
+// been written
+void cache_writer_unlock(char *cache_prefix);
+
+// Returns a copy of what is queued to be written to path (a cache prefix
+// followed by .js, .cache.json or .js.map.json), setting last_modified to
+// when it was queued, or NULL if nothing is
+char *cache_writer_get(char *path, time_t *last_modified);
+
+// Whether the artifacts queued for cache_prefix were compiled from a source
+// having source_hash, with build_key, setting queued to whether any are. If
+// none are, the manifest has the final word (see cache_manifest_valid).
+bool cache_writer_valid(char *cache_prefix, unsigned long long source_hash, char *build_key, bool *queued);
+
+// Waits until everything queued has been written
+void cache_writer_flush(void);
@@ -0,0 +1,411 @@
+#include <dirent.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "archive.h"
+#include "classpath.h"
+#include "globals.h"
+#include "str.h"
+#include "watch.h"
+
+// The index maps each relative path to the first classpath entry having it,
+// in an open-addressed hash table. Alongside it are the modification times
+// of every directory walked and every JAR read: a file being added or
+// removed changes the mtime of its directory, so comparing these is enough
+// to tell whether the index is stale. That check is done on a miss (as a
+// hit is verified by reading the file), at most once a second. When the
+// source directories are being watched (see watch.c), the watcher says
+// whether they have changed, and only the JARs are stat'ed.
+//
+// A miss is otherwise trusted, but so that a file this process has just
+// written (with spit, say) is never reported missing, writing or deleting
+// a file that may be on the classpath has the next miss check the stamps
+// straight away (see classpath_file_changed).
+//
+// Paths that the loader failed to find anywhere are kept in the same table
+// (with a src_path of -1), so that repeatedly probing for them, as loading
+// does when it tries each extension in turn, skips the bundle, the JARs and
+// out/. They are trusted just as misses are, and go with the rest of the
+// index whenever it is rebuilt: when a stamp or the watcher shows the
+// classpath changed.
+
+#define CLASSPATH_REVALIDATE_INTERVAL 1
+
+// Directories nested deeper than this (say, through a symlink cycle) are
+// not indexed
+#define CLASSPATH_MAX_DEPTH 64
+
+struct classpath_entry {
+    char *path;
+    int src_path;
+};
+
+struct classpath_stamp {
+    char *path;
+    long long mtime_ns;
+    off_t size;
+};
+
+static pthread_mutex_t classpath_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool classpath_built = false;
+static time_t classpath_validated = 0;
+static bool classpath_touched = false;
+
+static struct classpath_entry *classpath_table = NULL;
+static size_t classpath_capacity = 0;
+static size_t classpath_count = 0;
+
+static struct classpath_stamp *classpath_stamps = NULL;
+static size_t classpath_num_stamps = 0;
+
+static struct classpath_entry *classpath_slot(struct classpath_entry *table, size_t capacity, const char *path) {
+    size_t mask = capacity - 1;
+    size_t i = str_hash(path) & mask;
+    while (table[i].path != NULL && strcmp(table[i].path, path) != 0) {
+        i = (i + 1) & mask;
+    }
+    return &table[i];
+}
+
+static int classpath_find(const char *path) {
+    if (classpath_count == 0) {
+        return -1;
+    }
+    struct classpath_entry *slot = classpath_slot(classpath_table, classpath_capacity, path);
+    return slot->path != NULL ? slot->src_path : -1;
+}
+
+static bool classpath_noted_missing(const char *path) {
+    if (classpath_count == 0) {
+        return false;
+    }
+    struct classpath_entry *slot = classpath_slot(classpath_table, classpath_capacity, path);
+    return slot->path != NULL && slot->src_path == -1;
+}
+
+static void classpath_add(const char *path, int src_path) {
+    // Keep the load factor under 1/2
+    if (2 * (classpath_count + 1) > classpath_capacity) {
+        size_t capacity = classpath_capacity == 0 ? 1024 : 2 * classpath_capacity;
+        struct classpath_entry *table = calloc(capacity, sizeof(struct classpath_entry));
+        for (size_t i = 0; i < classpath_capacity; i++) {
+            if (classpath_table[i].path != NULL) {
+                *classpath_slot(table, capacity, classpath_table[i].path) = classpath_table[i];
+            }
+        }
+        free(classpath_table);
+        classpath_table = table;
+        classpath_capacity = capacity;
+    }
+
+    struct classpath_entry *slot = classpath_slot(classpath_table, classpath_capacity, path);
+    // Earlier classpath entries shadow later ones
+    if (slot->path == NULL) {
+        slot->path = strdup(path);
+        slot->src_path = src_path;
+        classpath_count++;
+    }
+}
+
+// Modification times need sub-second resolution, or a file added in the same
+// second as the index was built would go unnoticed
+static long long classpath_mtime_ns(struct stat *st) {
+#ifdef __APPLE__
+    return (long long) st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#else
+    return (long long) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+// Records the state of path, with a NULL st if it doesn't exist (so that
+// its later appearance is noticed)
+static void classpath_add_stamp(char *path, struct stat *st) {
+    classpath_stamps = realloc(classpath_stamps, (classpath_num_stamps + 1) * sizeof(struct classpath_stamp));
+    classpath_stamps[classpath_num_stamps].path = strdup(path);
+    classpath_stamps[classpath_num_stamps].mtime_ns = st != NULL ? classpath_mtime_ns(st) : 0;
+    classpath_stamps[classpath_num_stamps].size = st != NULL ? st->st_size : -1;
+    classpath_num_stamps++;
+}
+
+// Indexes the files under dir (a full path ending in /), whose path relative
+// to the classpath entry is prefix
+static void classpath_index_dir(int src_path, char *dir, char *prefix, int depth) {
+    if (depth > CLASSPATH_MAX_DEPTH) {
+        return;
+    }
+
+    struct stat st;
+    if (stat(dir, &st) != 0) {
+        classpath_add_stamp(dir, NULL);
+        return;
+    }
+    classpath_add_stamp(dir, &st);
+
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+
+        char *full_path = str_concat(dir, ent->d_name);
+        char *rel_path = str_concat(prefix, ent->d_name);
+
+        bool is_dir = false;
+#ifdef DT_DIR
+        if (ent->d_type == DT_DIR) {
+            is_dir = true;
+        } else if (ent->d_type == DT_LNK || ent->d_type == DT_UNKNOWN) {
+            is_dir = stat(full_path, &st) == 0 && S_ISDIR(st.st_mode);
+        }
+#else
+        is_dir = stat(full_path, &st) == 0 && S_ISDIR(st.st_mode);
+#endif
+
+        if (is_dir) {
+            char *sub_dir = str_concat(full_path, "/");
+            char *sub_prefix = str_concat(rel_path, "/");
+            classpath_index_dir(src_path, sub_dir, sub_prefix, depth + 1);
+            free(sub_dir);
+            free(sub_prefix);
+        } else {
+            classpath_add(rel_path, src_path);
+        }
+
+        free(full_path);
+        free(rel_path);
+    }
+
+    closedir(d);
+}
+
+static void classpath_add_jar_entry(const char *name, void *data) {
+    if (str_has_suffix((char *) name, "/") != 0) {
+        classpath_add(name, *(int *) data);
+    }
+}
+
+static void classpath_index_jar(int src_path, char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        classpath_add_stamp(path, NULL);
+        return;
+    }
+    classpath_add_stamp(path, &st);
+
+    for_each_entry_zip(path, classpath_add_jar_entry, &src_path);
+}
+
+static void classpath_clear() {
+    for (size_t i = 0; i < classpath_capacity; i++) {
+        free(classpath_table[i].path);
+    }
+    free(classpath_table);
+    classpath_table = NULL;
+    classpath_capacity = 0;
+    classpath_count = 0;
+
+    for (size_t i = 0; i < classpath_num_stamps; i++) {
+        free(classpath_stamps[i].path);
+    }
+    free(classpath_stamps);
+    classpath_stamps = NULL;
+    classpath_num_stamps = 0;
+
+    classpath_built = false;
+}
+
+static void classpath_build() {
+    for (int i = 0; i < config.num_src_paths; i++) {
+        char *type = config.src_paths[i].type;
+        char *location = config.src_paths[i].path;
+
+        if (strcmp(type, "src") == 0) {
+            classpath_index_dir(i, location, "", 0);
+        } else if (strcmp(type, "jar") == 0) {
+            classpath_index_jar(i, location);
+        }
+    }
+
+    classpath_built = true;
+    classpath_validated = time(NULL);
+
+    if (config.verbose) {
+        fprintf(stderr, "Indexed %zu classpath files\n", classpath_count);
+    }
+}
+
+// Whether a stamp has changed, skipping those of directories being watched
+// unless check_watched
+static bool classpath_stale(bool check_watched) {
+    bool watched = watch_active() && !check_watched;
+    for (size_t i = 0; i < classpath_num_stamps; i++) {
+        // Directory stamps end in /. Missing directories aren't watched.
+        if (watched && classpath_stamps[i].size != -1 && str_has_suffix(classpath_stamps[i].path, "/") == 0) {
+            continue;
+        }
+
+        struct stat st;
+        if (stat(classpath_stamps[i].path, &st) != 0) {
+            if (classpath_stamps[i].size != -1) {
+                return true;
+            }
+        } else if (classpath_mtime_ns(&st) != classpath_stamps[i].mtime_ns || st.st_size != classpath_stamps[i].size) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void classpath_rebuild() {
+    classpath_clear();
+    close_zips();
+    classpath_build();
+}
+
+// Rebuilds the index if the classpath has changed: if the watcher says so,
+// or if the stamps, checked at most once every
+// CLASSPATH_REVALIDATE_INTERVAL (or at once, if this process has written
+// to the classpath since), have changed. Called with classpath_lock held.
+static void classpath_revalidate() {
+    if (!classpath_built) {
+        classpath_build();
+        return;
+    }
+
+    // The watcher's word is free, so it is taken on every call
+    if (watch_active() && watch_dirs_changed()) {
+        classpath_validated = time(NULL);
+        classpath_touched = false;
+        classpath_rebuild();
+        return;
+    }
+
+    time_t now = time(NULL);
+    if (classpath_touched || now - classpath_validated >= CLASSPATH_REVALIDATE_INTERVAL) {
+        // The watcher may not have seen this process's own writes yet
+        bool check_watched = classpath_touched;
+        classpath_validated = now;
+        classpath_touched = false;
+        if (classpath_stale(check_watched)) {
+            classpath_rebuild();
+        }
+    }
+}
+
+void classpath_index() {
+    pthread_mutex_lock(&classpath_lock);
+    if (!classpath_built) {
+        classpath_build();
+    }
+    pthread_mutex_unlock(&classpath_lock);
+}
+
+int classpath_lookup(char *path) {
+    int src_path;
+
+    pthread_mutex_lock(&classpath_lock);
+
+    if (!classpath_built) {
+        classpath_build();
+    }
+
+    src_path = classpath_find(path);
+    if (src_path == -1) {
+        classpath_revalidate();
+        src_path = classpath_find(path);
+    }
+
+    pthread_mutex_unlock(&classpath_lock);
+
+    return src_path;
+}
+
+static int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char **) a, *(char **) b);
+}
+
+char **classpath_paths(size_t *count) {
+    pthread_mutex_lock(&classpath_lock);
+
+    if (!classpath_built) {
+        classpath_build();
+    } else {
+        classpath_revalidate();
+    }
+
+    char **paths = malloc((classpath_count + 1) * sizeof(char *));
+    *count = 0;
+    for (size_t i = 0; i < classpath_capacity; i++) {
+        if (classpath_table[i].path != NULL && classpath_table[i].src_path != -1) {
+            paths[(*count)++] = strdup(classpath_table[i].path);
+        }
+    }
+
+    pthread_mutex_unlock(&classpath_lock);
+
+    qsort(paths, *count, sizeof(char *), compare_paths);
+    return paths;
+}
+
+bool classpath_known_missing(char *path) {
+    bool missing = false;
+
+    pthread_mutex_lock(&classpath_lock);
+
+    if (!classpath_built) {
+        classpath_build();
+    }
+
+    if (classpath_noted_missing(path)) {
+        // Rebuilding the index, should the classpath have changed, forgets
+        // the paths noted missing
+        classpath_revalidate();
+        missing = classpath_noted_missing(path);
+    }
+
+    pthread_mutex_unlock(&classpath_lock);
+
+    return missing;
+}
+
+void classpath_note_missing(char *path) {
+    pthread_mutex_lock(&classpath_lock);
+    if (classpath_built) {
+        classpath_add(path, -1);
+    }
+    pthread_mutex_unlock(&classpath_lock);
+}
+
+void classpath_file_changed(char *path) {
+    // Relative paths may resolve anywhere
+    bool on_classpath = path[0] != '/';
+    for (int i = 0; i < config.num_src_paths && !on_classpath; i++) {
+        if (strcmp(config.src_paths[i].type, "src") == 0 &&
+            str_has_prefix(path, config.src_paths[i].path) == 0) {
+            on_classpath = true;
+        }
+    }
+
+    if (on_classpath) {
+        pthread_mutex_lock(&classpath_lock);
+        classpath_touched = true;
+        pthread_mutex_unlock(&classpath_lock);
+    }
+}
+
+void classpath_invalidate() {
+    pthread_mutex_lock(&classpath_lock);
+    classpath_clear();
+    close_zips();
+    pthread_mutex_unlock(&classpath_lock);
+}
@@ -0,0 +1,37 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+// An index of the files on the classpath (config.src_paths), so that
+// resolving a path is a single hash probe instead of a probe of every
+// source directory and JAR
+
+// Builds the index, if not already built
+void classpath_index();
+
+// Returns the index into config.src_paths of the first entry providing path,
+// or -1 if none does. The index is built on first use and revalidated when
+// a lookup misses, should the watcher have seen a change or the JAR and
+// directory modification times (checked at most once a second, unless
+// classpath_file_changed was called since) have changed.
+int classpath_lookup(char *path);
+
+// Returns the paths of the files on the classpath, sorted, setting count.
+// The caller frees the paths and the array.
+char **classpath_paths(size_t *count);
+
+// Whether path was noted missing since the classpath last changed, and is
+// still missing
+bool classpath_known_missing(char *path);
+
+// Notes that path could not be found by the loader (on the classpath or
+// elsewhere), so that later probes for it can be answered straight away
+void classpath_note_missing(char *path);
+
+// Notes that this process has written or deleted the file at path, so that
+// if it is on the classpath, the next miss looks for changes straight away
+void classpath_file_changed(char *path);
+
+// Discards the index (and closes the JARs kept open by archive.c), so that
+// the next lookup rebuilds it. Used when a file the index knows about turns
+// out to be gone.
+void classpath_invalidate();
@@ -16,6 +16,7 @@
 #include "jsc_utils.h"
 #include "str.h"
 #include "cljs.h"
+#include "trace.h"
 
 static volatile int keep_running = 1;
 
@@ -186,6 +187,62 @@ evaluate_source(JSContextRef ctx, char *type, char *source, bool expression, boo
     return ex != NULL ? ex : val;
 }
 
+#define CLOSURE_IMPORT_SCRIPT_DEF \
+    "CLOSURE_IMPORT_SCRIPT = function(src) { AMBLY_IMPORT_SCRIPT('goog/' + src); return true; }"
+
+// Skips files of the pre-linked boot script that have already been evaluated
+#define BOOT_CLOSURE_IMPORT_SCRIPT_DEF \
+    "CLOSURE_IMPORT_SCRIPT = function(src) {" \
+    "  if (!PLANCK_BOOT_PATHS[('goog/' + src).replace('goog/../', '')]) { AMBLY_IMPORT_SCRIPT('goog/' + src); }" \
+    "  return true; }"
+
+// Requires ns, whose file is at path. If the bundle has a pre-linked boot
+// script (see bundle_format.h), the files it has for ns are first evaluated
+// straight from it in dependency order, so that the goog.require calls made
+// along the way find them already loaded.
+void require_boot_ns(JSContextRef ctx, char *ns, char *path, char *source) {
+    char require[256];
+    snprintf(require, sizeof(require), "goog.require('%s');", ns);
+
+    size_t num_boot_files = config.out_path == NULL ? bundle_boot_num_files() : 0;
+    if (num_boot_files == 0) {
+        evaluate_script(ctx, require, source);
+        return;
+    }
+
+    JSValueRef boot_paths_ref = evaluate_script(ctx, "global.PLANCK_BOOT_PATHS = global.PLANCK_BOOT_PATHS || {};",
+                                                source);
+    JSObjectRef boot_paths = JSValueToObject(ctx, boot_paths_ref, NULL);
+    evaluate_script(ctx, BOOT_CLOSURE_IMPORT_SCRIPT_DEF, source);
+
+    for (size_t i = 0; i < num_boot_files; i++) {
+        char *root = NULL;
+        char *boot_source = NULL;
+        const uint16_t *utf16 = NULL;
+        size_t len = 0;
+        char *boot_path = bundle_boot_file(i, &root, &boot_source, &utf16, &len);
+        if (strcmp(root, path) != 0) {
+            continue;
+        }
+
+        trace_begin("import", boot_path);
+        if (utf16 != NULL) {
+            evaluate_script_utf16(ctx, utf16, len, boot_path);
+        } else {
+            evaluate_script(ctx, boot_source, boot_path);
+        }
+        trace_end("import", boot_path);
+
+        JSStringRef boot_path_str = JSStringCreateWithUTF8CString(boot_path);
+        JSObjectSetProperty(ctx, boot_paths, boot_path_str, JSValueMakeBoolean(ctx, true), kJSPropertyAttributeNone,
+                            NULL);
+        JSStringRelease(boot_path_str);
+    }
+
+    evaluate_script(ctx, require, source);
+    evaluate_script(ctx, CLOSURE_IMPORT_SCRIPT_DEF, source);
+}
+
 void bootstrap(JSContextRef ctx, char *out_path) {
     char *deps_file_path = "main.js";
     char *goog_base_path = "goog/base.js";
@@ -197,38 +254,51 @@ void bootstrap(JSContextRef ctx, char *out_path) {
     char source[] = "<bootstrap>";
 
     // Setup CLOSURE_IMPORT_SCRIPT
-    evaluate_script(ctx, "CLOSURE_IMPORT_SCRIPT = function(src) { AMBLY_IMPORT_SCRIPT('goog/' + src); return true; }",
-                    source);
+    evaluate_script(ctx, CLOSURE_IMPORT_SCRIPT_DEF, source);
 
     // Load goog base
+    trace_begin("startup", "goog base");
+    size_t base_script_len = 0;
+    const uint16_t *base_script_utf16 = NULL;
     char *base_script_str = NULL;
     if (out_path) {
         base_script_str = get_contents(goog_base_path, NULL);
         free(goog_base_path);
-    } else {
+    } else if ((base_script_utf16 = bundle_get_utf16(goog_base_path, &base_script_len)) == NULL) {
         base_script_str = bundle_get_contents(goog_base_path);
     }
-    if (base_script_str == NULL) {
+    if (base_script_utf16 != NULL) {
+        evaluate_script_utf16(ctx, base_script_utf16, base_script_len, "<bootstrap:base>");
+    } else if (base_script_str != NULL) {
+        evaluate_script(ctx, base_script_str, "<bootstrap:base>");
+        free(base_script_str);
+    } else {
         fprintf(stderr, "The goog base JavaScript text could not be loaded\n");
         exit(1);
     }
-    evaluate_script(ctx, base_script_str, "<bootstrap:base>");
-    free(base_script_str);
+    trace_end("startup", "goog base");
 
     // Load the deps file
+    trace_begin("startup", "deps");
+    size_t deps_script_len = 0;
+    const uint16_t *deps_script_utf16 = NULL;
     char *deps_script_str = NULL;
     if (out_path) {
         deps_script_str = get_contents(deps_file_path, NULL);
         free(deps_file_path);
-    } else {
+    } else if ((deps_script_utf16 = bundle_get_utf16(deps_file_path, &deps_script_len)) == NULL) {
         deps_script_str = bundle_get_contents(deps_file_path);
     }
-    if (deps_script_str == NULL) {
+    if (deps_script_utf16 != NULL) {
+        evaluate_script_utf16(ctx, deps_script_utf16, deps_script_len, "<bootstrap:deps>");
+    } else if (deps_script_str != NULL) {
+        evaluate_script(ctx, deps_script_str, "<bootstrap:deps>");
+        free(deps_script_str);
+    } else {
         fprintf(stderr, "The deps JavaScript text could not be loaded\n");
         exit(1);
     }
-    evaluate_script(ctx, deps_script_str, "<bootstrap:deps>");
-    free(deps_script_str);
+    trace_end("startup", "deps");
 
     evaluate_script(ctx, "goog.isProvided_ = function(x) { return false; };", source);
 
@@ -236,7 +306,9 @@ void bootstrap(JSContextRef ctx, char *out_path) {
                     "goog.require = function (name) { return CLOSURE_IMPORT_SCRIPT(goog.dependencies_.nameToPath[name]); };",
                     source);
 
-    evaluate_script(ctx, "goog.require('cljs.core');", source);
+    trace_begin("startup", "goog.require('cljs.core')");
+    require_boot_ns(ctx, "cljs.core", "cljs/core.js", source);
+    trace_end("startup", "goog.require('cljs.core')");
 
     // redef goog.require to track loaded libs
     evaluate_script(ctx,
@@ -309,12 +381,14 @@ char **get_completions(JSContextRef ctx, const char *buffer, int *num_completion
 }
 
 void register_global_function(JSContextRef ctx, char *name, JSObjectCallAsFunctionCallback handler) {
+    trace_begin("register", name);
     JSObjectRef global_obj = JSContextGetGlobalObject(ctx);
 
     JSStringRef fn_name = JSStringCreateWithUTF8CString(name);
     JSObjectRef fn_obj = JSObjectMakeFunctionWithCallback(ctx, fn_name, handler);
 
     JSObjectSetProperty(ctx, global_obj, fn_name, fn_obj, kJSPropertyAttributeNone, NULL);
+    trace_end("register", name);
 }
 
 void discarding_sender(const char *msg) {
@@ -324,13 +398,17 @@ void discarding_sender(const char *msg) {
 void *cljs_do_engine_init(void *data) {
     JSGlobalContextRef ctx = data;
 
+    trace_begin("startup", "engine init");
+
     JSStringRef nameRef = JSStringCreateWithUTF8CString("planck");
     JSGlobalContextSetName(ctx, nameRef);
 
     evaluate_script(ctx, "var global = this;", "<init>");
 
     register_global_function(ctx, "AMBLY_IMPORT_SCRIPT", function_import_script);
+    trace_begin("startup", "bootstrap");
     bootstrap(ctx, config.out_path);
+    trace_end("startup", "bootstrap");
 
     register_global_function(ctx, "PLANCK_CONSOLE_LOG", function_console_log);
     register_global_function(ctx, "PLANCK_CONSOLE_ERROR", function_console_error);
@@ -342,15 +420,23 @@ void *cljs_do_engine_init(void *data) {
     evaluate_script(ctx, "var PLANCK_VERSION = \"" PLANCK_VERSION "\";", "<init>");
 
     // require app namespaces
-    evaluate_script(ctx, "goog.require('planck.repl');", "<init>");
+    require_boot_ns(ctx, "planck.repl", "planck/repl.js", "<init>");
 
     // without this things won't work
     evaluate_script(ctx, "var window = global;", "<init>");
 
     register_global_function(ctx, "PLANCK_READ_FILE", function_read_file);
     register_global_function(ctx, "PLANCK_LOAD", function_load);
-    register_global_function(ctx, "PLANCK_LOAD_DEPS_CLJS_FILES", function_load_deps_cljs_files);
+    register_global_function(ctx, "PLANCK_DEPS_CLJS_JARS", function_deps_cljs_jars);
+    register_global_function(ctx, "PLANCK_LOAD_DEPS_CLJS_FILE", function_load_deps_cljs_file);
+    register_global_function(ctx, "PLANCK_CLOSURE_INDEX", function_closure_index);
+    register_global_function(ctx, "PLANCK_PREFETCH", function_prefetch);
+    register_global_function(ctx, "PLANCK_WATCH_CHANGES", function_watch_changes);
     register_global_function(ctx, "PLANCK_CACHE", function_cache);
+    register_global_function(ctx, "PLANCK_CACHE_VALID", function_cache_valid);
+    register_global_function(ctx, "PLANCK_CACHE_LOCK", function_cache_lock);
+    register_global_function(ctx, "PLANCK_CACHE_UNLOCK", function_cache_unlock);
+    register_global_function(ctx, "PLANCK_WRITE_CACHE_FILE", function_write_cache_file);
 
     register_global_function(ctx, "PLANCK_EVAL", function_eval);
 
@@ -394,6 +480,9 @@ void *cljs_do_engine_init(void *data) {
 
     register_global_function(ctx, "PLANCK_READ_PASSWORD", function_read_password);
 
+    register_global_function(ctx, "PLANCK_TRACE_BEGIN", function_trace_begin);
+    register_global_function(ctx, "PLANCK_TRACE_END", function_trace_end);
+
     {
         JSValueRef arguments[config.num_rest_args];
         for (int i = 0; i < config.num_rest_args; i++) {
@@ -416,7 +505,7 @@ void *cljs_do_engine_init(void *data) {
     cljs_set_print_sender(ctx, &discarding_sender);
 
     {
-        JSValueRef arguments[5];
+        JSValueRef arguments[7];
         arguments[0] = JSValueMakeBoolean(ctx, config.repl);
         arguments[1] = JSValueMakeBoolean(ctx, config.verbose);
         JSValueRef cache_path_ref = NULL;
@@ -427,9 +516,13 @@ void *cljs_do_engine_init(void *data) {
         arguments[2] = cache_path_ref;
         arguments[3] = JSValueMakeBoolean(ctx, config.static_fns);
         arguments[4] = JSValueMakeBoolean(ctx, config.elide_asserts);
+        arguments[5] = JSValueMakeBoolean(ctx, config.auto_reload);
+        arguments[6] = config.shared_cache_path != NULL ? c_string_to_value(ctx, config.shared_cache_path) : NULL;
         JSValueRef ex = NULL;
-        JSObjectCallAsFunction(ctx, get_function(ctx, "planck.repl", "init"), JSContextGetGlobalObject(ctx), 5,
+        trace_begin("startup", "planck.repl/init");
+        JSObjectCallAsFunction(ctx, get_function(ctx, "planck.repl", "init"), JSContextGetGlobalObject(ctx), 7,
                                arguments, &ex);
+        trace_end("startup", "planck.repl/init");
         debug_print_value("planck.repl/init", ctx, ex);
     }
 
@@ -443,6 +536,9 @@ void *cljs_do_engine_init(void *data) {
     evaluate_script(ctx, "goog.provide('cljs.user');", "<init>");
     evaluate_script(ctx, "goog.require('cljs.core');", "<init>");
 
+    trace_end("startup", "engine init");
+
+    bundle_boot_complete();
     signal_engine_ready();
 
     return NULL;
@@ -24,6 +24,8 @@ char **get_completions(JSContextRef ctx, const char *buffer, int *num_completion
 
 extern bool cljs_engine_ready;
 
+void block_until_engine_ready();
+
 void cljs_engine_init(JSContextRef ctx);
 
 void cljs_set_print_sender(JSContextRef ctx, void (*sender)(const char *msg));
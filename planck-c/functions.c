@@ -12,15 +12,26 @@
 #include <JavaScriptCore/JavaScript.h>
 
 #include "bundle.h"
+#include "cache_lock.h"
+#include "cache_manifest.h"
+#include "cache_pack.h"
+#include "cache_prune.h"
+#include "cache_writer.h"
+#include "classpath.h"
 #include "globals.h"
 #include "io.h"
 #include "jsc_utils.h"
+#include "load.h"
+#include "prefetch.h"
+#include "preload.h"
 #include "str.h"
+#include "watch.h"
 #include "archive.h"
 #include "file.h"
 #include "timers.h"
 #include "cljs.h"
 #include "repl.h"
+#include "trace.h"
 
 #define CONSOLE_LOG_BUF_SIZE 1000
 char console_log_buf[CONSOLE_LOG_BUF_SIZE];
@@ -57,29 +68,79 @@ JSValueRef function_console_error(JSContextRef ctx, JSObjectRef function, JSObje
     return JSValueMakeUndefined(ctx);
 }
 
+// Whether the optional argument at index i, asking for the content hash of
+// what is read, is true
+static bool wants_content_hash(JSContextRef ctx, size_t argc, const JSValueRef args[], size_t i) {
+    return argc > i && JSValueGetType(ctx, args[i]) == kJSTypeBoolean && JSValueToBoolean(ctx, args[i]);
+}
+
+// The content hash of a source, as used by the cache manifest
+static JSValueRef content_hash_value(JSContextRef ctx, const char *contents) {
+    char hash[17];
+    snprintf(hash, sizeof(hash), "%016llx", str_hash64(contents));
+    return c_string_to_value(ctx, hash);
+}
+
 JSValueRef function_read_file(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                               size_t argc, const JSValueRef args[], JSValueRef *exception) {
     // TODO: implement fully
 
-    if (argc == 1 && JSValueGetType(ctx, args[0]) == kJSTypeString) {
-        char path[100];
+    if (argc >= 1 && JSValueGetType(ctx, args[0]) == kJSTypeString) {
+        char path[PATH_MAX];
         JSStringRef path_str = JSValueToStringCopy(ctx, args[0], NULL);
-        assert(JSStringGetLength(path_str) < 100);
-        JSStringGetUTF8CString(path_str, path, 100);
+        assert(JSStringGetLength(path_str) < PATH_MAX);
+        JSStringGetUTF8CString(path_str, path, PATH_MAX);
         JSStringRelease(path_str);
 
         // debug_print_value("read_file", ctx, args[0]);
 
         time_t last_modified = 0;
-        char *contents = get_contents(path, &last_modified);
+        size_t map_size = 0;
+        void *pack_handle = NULL;
+        char *contents = NULL;
+        bool in_cache = (config.cache_path != NULL && str_has_prefix(path, config.cache_path) == 0) ||
+                        (config.shared_cache_path != NULL && str_has_prefix(path, config.shared_cache_path) == 0);
+        if (in_cache) {
+            // Written cache files may still be queued
+            contents = cache_writer_get(path, &last_modified);
+        }
         if (contents != NULL) {
+            // Served as it will be written
+        } else if (cache_pack_owns(path)) {
+            contents = cache_pack_get(path, &last_modified, &pack_handle);
+        } else {
+            contents = get_preloaded(path, &last_modified);
+            if (contents == NULL && !get_prefetched(true, path, &contents, &last_modified, NULL)) {
+                // Only cache files, which are replaced rather than rewritten,
+                // are safe to map
+                if (in_cache) {
+                    contents = get_contents_mapped(path, &last_modified, &map_size);
+                } else {
+                    contents = get_contents(path, &last_modified);
+                }
+            }
+            if (contents != NULL && in_cache) {
+                // For evicting the least recently used
+                cache_touch(path);
+            }
+        }
+        if (contents != NULL) {
+            bool hash = wants_content_hash(ctx, argc, args, 1);
+            JSValueRef res[3];
+            if (hash) {
+                res[2] = content_hash_value(ctx, contents);
+            }
+
             JSStringRef contents_str = JSStringCreateWithUTF8CString(contents);
-            free(contents);
+            if (pack_handle != NULL) {
+                cache_pack_release(pack_handle);
+            } else {
+                release_contents(contents, map_size);
+            }
 
-            JSValueRef res[2];
             res[0] = JSValueMakeString(ctx, contents_str);
             res[1] = JSValueMakeNumber(ctx, last_modified);
-            return JSObjectMakeArray(ctx, 2, res, NULL);
+            return JSObjectMakeArray(ctx, hash ? 3 : 2, res, NULL);
         }
     }
 
@@ -90,7 +151,7 @@ JSValueRef function_load(JSContextRef ctx, JSObjectRef function, JSObjectRef thi
                          size_t argc, const JSValueRef args[], JSValueRef *exception) {
     // TODO: implement fully
 
-    if (argc == 1 && JSValueGetType(ctx, args[0]) == kJSTypeString) {
+    if (argc >= 1 && JSValueGetType(ctx, args[0]) == kJSTypeString) {
         char path[PATH_MAX];
         JSStringRef path_str = JSValueToStringCopy(ctx, args[0], NULL);
         assert(JSStringGetLength(path_str) < PATH_MAX);
@@ -100,108 +161,150 @@ JSValueRef function_load(JSContextRef ctx, JSObjectRef function, JSObjectRef thi
         // debug_print_value("load", ctx, args[0]);
 
         time_t last_modified = 0;
+        char *loaded_path = NULL;
         char *contents = NULL;
-        char *loaded_path = strdup(path);
-
-        bool developing = (config.num_src_paths == 1 &&
-                           strcmp(config.src_paths[0].type, "src") == 0 &&
-                           str_has_suffix(config.src_paths[0].path, "/planck-cljs/src/") == 0);
-
-        if (!developing) {
-            contents = bundle_get_contents(path);
-            last_modified = 0;
+        if (!get_prefetched(false, path, &contents, &last_modified, &loaded_path)) {
+            contents = load_contents(path, &last_modified, &loaded_path);
         }
 
-        // load from classpath
-        if (contents == NULL) {
-            for (int i = 0; i < config.num_src_paths; i++) {
-                char *type = config.src_paths[i].type;
-                char *location = config.src_paths[i].path;
-
-                if (strcmp(type, "src") == 0) {
-                    char *full_path = str_concat(location, path);
-                    contents = get_contents(full_path, &last_modified);
-                    if (contents != NULL) {
-                        free(loaded_path);
-                        loaded_path = strdup(full_path);
-                    }
-                    free(full_path);
-                } else if (strcmp(type, "jar") == 0) {
-                    contents = get_contents_zip(location, path, &last_modified);
-                }
-
-                if (contents != NULL) {
-                    break;
-                }
-            }
-        }
-
-        // load from out/
-        if (contents == NULL) {
-            if (config.out_path != NULL) {
-                char *full_path = str_concat(config.out_path, path);
-                contents = get_contents(full_path, &last_modified);
-                free(full_path);
+        if (contents != NULL) {
+            // Bundled sources are never compiled to the cache directory
+            bool hash = wants_content_hash(ctx, argc, args, 1) && last_modified != 0;
+            JSValueRef res[5];
+            if (hash) {
+                res[3] = content_hash_value(ctx, contents);
+                // Whether the source is from a JAR, and so may be compiled
+                // to the shared cache
+                int i = strcmp(loaded_path, path) == 0 ? classpath_lookup(path) : -1;
+                res[4] = JSValueMakeBoolean(ctx, i != -1 && strcmp(config.src_paths[i].type, "jar") == 0);
             }
-        }
 
-        if (developing && contents == NULL) {
-            contents = bundle_get_contents(path);
-            last_modified = 0;
-        }
-
-        if (contents != NULL) {
             JSStringRef contents_str = JSStringCreateWithUTF8CString(contents);
             free(contents);
             JSStringRef loaded_path_str = JSStringCreateWithUTF8CString(loaded_path);
             free(loaded_path);
 
-            JSValueRef res[3];
             res[0] = JSValueMakeString(ctx, contents_str);
             res[1] = JSValueMakeNumber(ctx, last_modified);
             res[2] = JSValueMakeString(ctx, loaded_path_str);
-            return JSObjectMakeArray(ctx, 3, res, NULL);
+            return JSObjectMakeArray(ctx, hash ? 5 : 3, res, NULL);
         }
     }
 
     return JSValueMakeNull(ctx);
 }
 
-JSValueRef function_load_deps_cljs_files(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
-                                         size_t argc, const JSValueRef args[], JSValueRef *exception) {
-    size_t num_files = 0;
-    char **deps_cljs_files = NULL;
+JSValueRef function_deps_cljs_jars(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                   size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    size_t num_jars = 0;
+    JSValueRef jars[config.num_src_paths + 1];
 
     if (argc == 0) {
         for (int i = 0; i < config.num_src_paths; i++) {
             char *type = config.src_paths[i].type;
             char *location = config.src_paths[i].path;
 
-            if (strcmp(type, "jar") == 0) {
-                char *source = get_contents_zip(location, "deps.cljs", NULL);
-                if (source != NULL) {
-                    num_files += 1;
-                    deps_cljs_files = realloc(deps_cljs_files, num_files * sizeof(char *));
-                    deps_cljs_files[num_files - 1] = source;
-                }
+            struct stat jar_stat;
+            if (strcmp(type, "jar") == 0 && stat(location, &jar_stat) == 0) {
+                char fingerprint[64];
+                snprintf(fingerprint, sizeof(fingerprint), "%lld:%lld", (long long) jar_stat.st_size,
+                         (long long) jar_stat.st_mtime);
+
+                JSValueRef jar[2];
+                jar[0] = c_string_to_value(ctx, location);
+                jar[1] = c_string_to_value(ctx, fingerprint);
+                jars[num_jars++] = JSObjectMakeArray(ctx, 2, jar, NULL);
             }
         }
     }
 
-    JSValueRef files[num_files];
-    for (int i = 0; i < num_files; i++) {
-        JSStringRef file = JSStringCreateWithUTF8CString(deps_cljs_files[i]);
-        files[i] = JSValueMakeString(ctx, file);
-        free(deps_cljs_files[i]);
+    return JSObjectMakeArray(ctx, num_jars, jars, NULL);
+}
+
+JSValueRef function_load_deps_cljs_file(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                        size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 1 && JSValueGetType(ctx, args[0]) == kJSTypeString) {
+        char *jar_path = value_to_c_string(ctx, args[0]);
+        char *source = get_contents_zip(jar_path, "deps.cljs", NULL);
+        free(jar_path);
+
+        if (source != NULL) {
+            JSValueRef rv = c_string_to_value(ctx, source);
+            free(source);
+            return rv;
+        }
+    }
+
+    return JSValueMakeNull(ctx);
+}
+
+JSValueRef function_closure_index(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                  size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 1 && JSValueGetType(ctx, args[0]) == kJSTypeString) {
+        char *name = value_to_c_string(ctx, args[0]);
+        char *path = bundle_closure_path(name);
+        free(name);
+
+        if (path != NULL) {
+            JSValueRef rv = c_string_to_value(ctx, path);
+            free(path);
+            return rv;
+        }
+    }
+
+    return JSValueMakeNull(ctx);
+}
+
+static void prefetch_array(JSContextRef ctx, JSValueRef value, bool is_file) {
+    if (JSValueGetType(ctx, value) != kJSTypeObject) {
+        return;
+    }
+    JSObjectRef array = JSValueToObject(ctx, value, NULL);
+    unsigned int count = array_get_count(ctx, array);
+    for (unsigned int i = 0; i < count; i++) {
+        JSValueRef path_ref = array_get_value_at_index(ctx, array, i);
+        if (JSValueGetType(ctx, path_ref) == kJSTypeString) {
+            char *path = value_to_c_string(ctx, path_ref);
+            prefetch(is_file, path);
+            free(path);
+        }
+    }
+}
+
+JSValueRef function_prefetch(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                             size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 2) {
+        prefetch_array(ctx, args[0], false);
+        prefetch_array(ctx, args[1], true);
     }
-    free(deps_cljs_files);
 
-    return JSObjectMakeArray(ctx, num_files, files, NULL);
+    return JSValueMakeNull(ctx);
+}
+
+JSValueRef function_watch_changes(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                  size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (!watch_active()) {
+        return JSValueMakeNull(ctx);
+    }
+
+    size_t count = 0;
+    char **paths = watch_changes(&count);
+
+    JSValueRef *values = malloc(count * sizeof(JSValueRef));
+    for (size_t i = 0; i < count; i++) {
+        values[i] = c_string_to_value(ctx, paths[i]);
+        free(paths[i]);
+    }
+    free(paths);
+
+    JSObjectRef rv = JSObjectMakeArray(ctx, count, values, NULL);
+    free(values);
+    return rv;
 }
 
 JSValueRef function_cache(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                           size_t argc, const JSValueRef args[], JSValueRef *exception) {
-    if (argc == 4 &&
+    if (argc >= 4 &&
         JSValueGetType(ctx, args[0]) == kJSTypeString &&
         JSValueGetType(ctx, args[1]) == kJSTypeString &&
         (JSValueGetType(ctx, args[2]) == kJSTypeString
@@ -215,40 +318,102 @@ JSValueRef function_cache(JSContextRef ctx, JSObjectRef function, JSObjectRef th
         char *cache = value_to_c_string(ctx, args[2]);
         char *sourcemap = value_to_c_string(ctx, args[3]);
 
-        char *suffix = NULL;
-        int max_suffix_len = 20;
-        size_t prefix_len = strlen(cache_prefix);
-        char *path = malloc((prefix_len + max_suffix_len) * sizeof(char));
-        memset(path, 0, prefix_len + max_suffix_len);
-
-        suffix = ".js";
-        strcpy(path, cache_prefix);
-        strcat(path, suffix);
-        write_contents(path, source);
-
-        suffix = ".cache.json";
-        strcpy(path, cache_prefix);
-        strcat(path, suffix);
-        write_contents(path, cache);
-
-        suffix = ".js.map.json";
-        strcpy(path, cache_prefix);
-        strcat(path, suffix);
-        if (sourcemap) {
-            write_contents(path, sourcemap);
+        // The source hash and build key, if given, record what was cached in
+        // the manifest
+        char *source_hash = NULL;
+        char *build_key = NULL;
+        if (argc >= 6 &&
+            JSValueGetType(ctx, args[4]) == kJSTypeString &&
+            JSValueGetType(ctx, args[5]) == kJSTypeString) {
+            source_hash = value_to_c_string(ctx, args[4]);
+            build_key = value_to_c_string(ctx, args[5]);
+        }
+
+        cache_writer_submit(cache_prefix, source, cache, sourcemap, source_hash, build_key);
+    }
+
+    return JSValueMakeNull(ctx);
+}
+
+JSValueRef function_cache_valid(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 3 &&
+        JSValueGetType(ctx, args[0]) == kJSTypeString &&
+        JSValueGetType(ctx, args[1]) == kJSTypeString &&
+        JSValueGetType(ctx, args[2]) == kJSTypeString) {
+        char *cache_prefix = value_to_c_string(ctx, args[0]);
+        char *source_hash = value_to_c_string(ctx, args[1]);
+        char *build_key = value_to_c_string(ctx, args[2]);
+
+        // What is queued to be written is checked first, as the manifest
+        // only has it once written
+        bool queued = false;
+        unsigned long long hash = strtoull(source_hash, NULL, 16);
+        bool valid = cache_writer_valid(cache_prefix, hash, build_key, &queued);
+        if (!queued) {
+            valid = cache_manifest_valid(cache_prefix, hash, build_key);
         }
 
         free(cache_prefix);
-        free(source);
-        free(cache);
-        free(sourcemap);
+        free(source_hash);
+        free(build_key);
 
-        free(path);
+        return JSValueMakeBoolean(ctx, valid);
+    }
+
+    return JSValueMakeBoolean(ctx, false);
+}
+
+JSValueRef function_cache_lock(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                               size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 1 && JSValueGetType(ctx, args[0]) == kJSTypeString) {
+        char *cache_prefix = value_to_c_string(ctx, args[0]);
+
+        bool waited = cache_lock_acquire(cache_prefix);
+
+        free(cache_prefix);
+
+        return JSValueMakeBoolean(ctx, waited);
+    }
+
+    return JSValueMakeBoolean(ctx, false);
+}
+
+JSValueRef function_cache_unlock(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                 size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 1 && JSValueGetType(ctx, args[0]) == kJSTypeString) {
+        // Released once what was compiled under the lock has been written
+        cache_writer_unlock(value_to_c_string(ctx, args[0]));
     }
 
     return JSValueMakeNull(ctx);
 }
 
+JSValueRef function_write_cache_file(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                     size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 2 &&
+        JSValueGetType(ctx, args[0]) == kJSTypeString &&
+        JSValueGetType(ctx, args[1]) == kJSTypeString) {
+        char *path = value_to_c_string(ctx, args[0]);
+        char *contents = value_to_c_string(ctx, args[1]);
+
+        // Replaced atomically, as cache files may be mapped by readers
+        bool written = true;
+        if (cache_pack_owns(path)) {
+            cache_pack_put(path, contents);
+        } else {
+            written = write_contents_atomic(path, contents);
+        }
+
+        free(path);
+        free(contents);
+
+        return JSValueMakeBoolean(ctx, written);
+    }
+
+    return JSValueMakeBoolean(ctx, false);
+}
+
 JSValueRef function_eval(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                          size_t argc, const JSValueRef args[], JSValueRef *exception) {
     JSValueRef val = NULL;
@@ -399,8 +564,14 @@ JSValueRef function_import_script(JSContextRef ctx, JSObjectRef function, JSObje
             path = path + 8;
         }
 
+        trace_begin("import", path);
+
         char *source = NULL;
-        if (config.out_path == NULL) {
+        const uint16_t *utf16 = NULL;
+        size_t len = 0;
+        if (config.out_path == NULL && (utf16 = bundle_get_utf16(path, &len)) != NULL) {
+            evaluate_script_utf16(ctx, utf16, len, path);
+        } else if (config.out_path == NULL) {
             source = bundle_get_contents(path);
         } else {
             char *full_path = str_concat(config.out_path, path);
@@ -412,6 +583,8 @@ JSValueRef function_import_script(JSContextRef ctx, JSObjectRef function, JSObje
             evaluate_script(ctx, source, path);
             free(source);
         }
+
+        trace_end("import", path);
     }
 
     return JSValueMakeUndefined(ctx);
@@ -498,6 +671,7 @@ JSValueRef function_file_writer_open(JSContextRef ctx, JSObjectRef function, JSO
         char *encoding = value_to_c_string(ctx, args[2]);
 
         uint64_t descriptor = ufile_open_write(path, append, encoding);
+        classpath_file_changed(path);
 
         free(path);
         free(encoding);
@@ -611,6 +785,7 @@ JSValueRef function_file_output_stream_open(JSContextRef ctx, JSObjectRef functi
         bool append = JSValueToBoolean(ctx, args[1]);
 
         uint64_t descriptor = file_open_write(path, append);
+        classpath_file_changed(path);
 
         free(path);
 
@@ -675,6 +850,7 @@ JSValueRef function_delete_file(JSContextRef ctx, JSObjectRef function, JSObject
 
         char *path = value_to_c_string(ctx, args[0]);
         remove(path);
+        classpath_file_changed(path);
         free(path);
     }
     return JSValueMakeNull(ctx);
@@ -887,6 +1063,28 @@ JSValueRef function_read_password(JSContextRef ctx, JSObjectRef function, JSObje
     return JSValueMakeNull(ctx);
 }
 
+JSValueRef function_trace_begin(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 1 && JSValueGetType(ctx, args[0]) == kJSTypeString) {
+        char *name = value_to_c_string(ctx, args[0]);
+        trace_begin("cljs", name);
+        free(name);
+    }
+
+    return JSValueMakeNull(ctx);
+}
+
+JSValueRef function_trace_end(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                              size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 1 && JSValueGetType(ctx, args[0]) == kJSTypeString) {
+        char *name = value_to_c_string(ctx, args[0]);
+        trace_end("cljs", name);
+        free(name);
+    }
+
+    return JSValueMakeNull(ctx);
+}
+
 struct timeout_data_t {
     unsigned long long id;
 };
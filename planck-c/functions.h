@@ -12,13 +12,37 @@ JSValueRef
 function_load(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc, const JSValueRef args[],
               JSValueRef *exception);
 
-JSValueRef function_load_deps_cljs_files(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc,
-                                         const JSValueRef args[], JSValueRef *exception);
+JSValueRef function_deps_cljs_jars(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc,
+                                   const JSValueRef args[], JSValueRef *exception);
+
+JSValueRef function_load_deps_cljs_file(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc,
+                                        const JSValueRef args[], JSValueRef *exception);
+
+JSValueRef function_closure_index(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc,
+                                  const JSValueRef args[], JSValueRef *exception);
+
+JSValueRef function_prefetch(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc,
+                             const JSValueRef args[], JSValueRef *exception);
+
+JSValueRef function_watch_changes(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc,
+                                  const JSValueRef args[], JSValueRef *exception);
 
 JSValueRef
 function_cache(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc, const JSValueRef args[],
                JSValueRef *exception);
 
+JSValueRef function_cache_valid(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc,
+                                const JSValueRef args[], JSValueRef *exception);
+
+JSValueRef function_cache_lock(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc,
+                               const JSValueRef args[], JSValueRef *exception);
+
+JSValueRef function_cache_unlock(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc,
+                                 const JSValueRef args[], JSValueRef *exception);
+
+JSValueRef function_write_cache_file(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc,
+                                     const JSValueRef args[], JSValueRef *exception);
+
 JSValueRef
 function_eval(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc, const JSValueRef args[],
               JSValueRef *exception);
@@ -108,5 +132,11 @@ function_fstat(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, s
 JSValueRef function_read_password(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc,
                                   const JSValueRef args[], JSValueRef *exception);
 
+JSValueRef function_trace_begin(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc,
+                                const JSValueRef args[], JSValueRef *exception);
+
+JSValueRef function_trace_end(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc,
+                              const JSValueRef args[], JSValueRef *exception);
+
 JSValueRef function_set_timeout(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                                 size_t argc, const JSValueRef args[], JSValueRef *exception);
\ No newline at end of file
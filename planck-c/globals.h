@@ -27,6 +27,7 @@ struct config {
     bool elide_asserts;
     char *theme;
     bool dumb_terminal;
+    bool auto_reload;
 
     char *main_ns_name;
     size_t num_rest_args;
@@ -34,6 +35,10 @@ struct config {
 
     char *out_path;
     char *cache_path;
+    bool cache_pack;
+    char *shared_cache_path;
+    unsigned long long cache_max_size;
+    long cache_max_age;
 
     size_t num_src_paths;
     struct src_path *src_paths;
@@ -1,67 +1,152 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
-#define CHUNK_SIZE 1024
+#include "io.h"
 
-char *read_all(FILE *f) {
-    int len = CHUNK_SIZE + 1;
-    char *buf = malloc(len * sizeof(char));
+#define CHUNK_SIZE 65536
+
+// Files smaller than this are cheaper to read than to map
+#define MMAP_THRESHOLD (64 * 1024)
+
+// The most read from a file that isn't a regular file, which may never end
+#define STREAM_MAX (64 * 1024 * 1024)
+
+// Reads f to the end, failing if that is more than max bytes
+static char *read_all_max(FILE *f, size_t max) {
+    size_t len = CHUNK_SIZE;
+    char *buf = malloc(len);
 
     size_t offset = 0;
     for (;;) {
-        if (len - offset < CHUNK_SIZE) {
-            len = 2 * len + CHUNK_SIZE;
-            buf = realloc(buf, len * sizeof(char));
+        if (offset > max) {
+            free(buf);
+            return NULL;
         }
-        size_t n = fread(buf + offset, 1, CHUNK_SIZE, f);
-        offset += n;
-        if (feof(f)) {
-            break;
+        if (offset == len - 1) {
+            len *= 2;
+            buf = realloc(buf, len);
         }
+        size_t n = fread(buf + offset, 1, len - 1 - offset, f);
+        offset += n;
         if (ferror(f)) {
+            free(buf);
             return NULL;
         }
+        if (n == 0 || feof(f)) {
+            break;
+        }
     }
-    memset(buf + offset, 0, len - offset);
+    buf[offset] = '\0';
     return buf;
 }
 
-char *get_contents(char *path, time_t *last_modified) {
-    FILE *f = fopen(path, "r");
-    if (f == NULL) {
-        goto err;
+char *read_all(FILE *f) {
+    return read_all_max(f, SIZE_MAX);
+}
+
+// Reads a regular file of known size in one go
+static char *read_regular(int fd, size_t size) {
+    char *buf = malloc(size + 1);
+    size_t offset = 0;
+    while (offset < size) {
+        ssize_t n = read(fd, buf + offset, size - offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            free(buf);
+            return NULL;
+        }
+        if (n == 0) {
+            break;
+        }
+        offset += n;
     }
+    buf[offset] = '\0';
+    return buf;
+}
+
+// Reads the file open on fd, streaming it if it isn't a regular file (a pipe,
+// say, or /dev/stdin), in which case it fails if there is more than
+// STREAM_MAX (as there is no end to /dev/zero, say), and mapping it if
+// map_size is non-NULL and it is large enough to be worth it. Closes fd.
+static char *read_fd(int fd, time_t *last_modified, size_t *map_size) {
+    char *contents = NULL;
 
     struct stat f_stat;
-    if (fstat(fileno(f), &f_stat) < 0) {
-        goto err;
+    if (fstat(fd, &f_stat) < 0) {
+        close(fd);
+        return NULL;
     }
 
     if (last_modified != NULL) {
         *last_modified = f_stat.st_mtime;
     }
 
-    char *buf = malloc(f_stat.st_size + 1);
-    memset(buf, 0, f_stat.st_size);
-    fread(buf, f_stat.st_size, 1, f);
-    buf[f_stat.st_size] = '\0';
-    if (ferror(f)) {
-        free(buf);
-        goto err;
+    if (!S_ISREG(f_stat.st_mode)) {
+        FILE *f = fdopen(fd, "r");
+        if (f == NULL) {
+            close(fd);
+            return NULL;
+        }
+        contents = read_all_max(f, STREAM_MAX);
+        fclose(f);
+        return contents;
     }
 
-    if (fclose(f) < 0) {
-        goto err;
+    // The mapping is only NUL-terminated, by the zero fill of its last page,
+    // if the file doesn't end on a page boundary
+    if (map_size != NULL && f_stat.st_size >= MMAP_THRESHOLD
+        && f_stat.st_size % sysconf(_SC_PAGESIZE) != 0) {
+        void *addr = mmap(NULL, f_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+            close(fd);
+            *map_size = f_stat.st_size;
+            return addr;
+        }
     }
 
-    return buf;
+    contents = read_regular(fd, (size_t) f_stat.st_size);
+    close(fd);
+    return contents;
+}
+
+char *get_contents(char *path, time_t *last_modified) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
 
-    err:
-    return NULL;
+    return read_fd(fd, last_modified, NULL);
+}
+
+char *get_contents_mapped(char *path, time_t *last_modified, size_t *map_size) {
+    *map_size = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    return read_fd(fd, last_modified, map_size);
+}
+
+void release_contents(char *contents, size_t map_size) {
+    if (map_size != 0) {
+        munmap(contents, map_size);
+    } else {
+        free(contents);
+    }
 }
 
 void write_contents(char *path, char *contents) {
@@ -87,8 +172,53 @@ void write_contents(char *path, char *contents) {
     return;
 }
 
+bool write_contents_atomic(char *path, char *contents) {
+    static unsigned int counter = 0;
+
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.%u.tmp", path, (int) getpid(),
+             __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED));
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    size_t len = strlen(contents);
+    size_t offset = 0;
+    while (offset < len) {
+        ssize_t n = write(fd, contents + offset, len - offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        offset += n;
+    }
+
+    if (close(fd) != 0 || offset < len || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return false;
+    }
+
+    return true;
+}
+
 int mkdir_p(char *path) {
     int res = mkdir(path, 0755);
+    if (res < 0 && errno == ENOENT) {
+        // Create the parent first
+        char *slash = strrchr(path, '/');
+        if (slash != NULL && slash != path) {
+            char *parent = strndup(path, slash - path);
+            res = mkdir_p(parent);
+            free(parent);
+            if (res == 0) {
+                res = mkdir(path, 0755);
+            }
+        }
+    }
     if (res < 0 && errno == EEXIST) {
         return 0;
     }
@@ -1,9 +1,23 @@
+#include <stdbool.h>
 #include <time.h>
 
 char *read_all(FILE *f);
 
 char *get_contents(char *path, time_t *last_modified);
 
+// Like get_contents, but large files are mapped rather than read, in which
+// case map_size is set to the size of the mapping. The contents must be
+// released with release_contents. As a mapped file that is truncated raises
+// SIGBUS, this is only for files that are replaced (by rename) rather than
+// rewritten, such as those in the cache.
+char *get_contents_mapped(char *path, time_t *last_modified, size_t *map_size);
+
+void release_contents(char *contents, size_t map_size);
+
 void write_contents(char *path, char *contents);
 
+// Writes contents to a temporary file that is then renamed to path, so that
+// readers see either the old contents or all of the new
+bool write_contents_atomic(char *path, char *contents);
+
 int mkdir_p(char *path);
\ No newline at end of file
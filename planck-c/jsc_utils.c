@@ -6,6 +6,11 @@
 
 #include "jsc_utils.h"
 
+#ifdef HAVE_JSSTRING_NOCOPY
+// Exported by JavaScriptCore, but only declared in its private headers
+JS_EXPORT JSStringRef JSStringCreateWithCharactersNoCopy(const JSChar *chars, size_t numChars);
+#endif
+
 JSStringRef to_string(JSContextRef ctx, JSValueRef val) {
     if (JSValueIsUndefined(ctx, val)) {
         return JSStringCreateWithUTF8CString("undefined");
@@ -50,6 +55,27 @@ JSValueRef evaluate_script(JSContextRef ctx, char *script, char *source) {
     return val;
 }
 
+JSValueRef evaluate_script_utf16(JSContextRef ctx, const JSChar *script, size_t len, char *source) {
+#ifdef HAVE_JSSTRING_NOCOPY
+    JSStringRef script_ref = JSStringCreateWithCharactersNoCopy(script, len);
+#else
+    JSStringRef script_ref = JSStringCreateWithCharacters(script, len);
+#endif
+    JSStringRef source_ref = NULL;
+    if (source != NULL) {
+        source_ref = JSStringCreateWithUTF8CString(source);
+    }
+
+    JSValueRef ex = NULL;
+    JSValueRef val = JSEvaluateScript(ctx, script_ref, NULL, source_ref, 0, &ex);
+    JSStringRelease(script_ref);
+    if (source != NULL) {
+        JSStringRelease(source_ref);
+    }
+
+    return val;
+}
+
 char *value_to_c_string(JSContextRef ctx, JSValueRef val) {
     if (JSValueIsNull(ctx, val)) {
         return NULL;
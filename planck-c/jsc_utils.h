@@ -12,6 +12,10 @@ void print_value(char *prefix, JSContextRef ctx, JSValueRef val);
 
 JSValueRef evaluate_script(JSContextRef ctx, char *script, char *source);
 
+// Evaluates UTF-16 script text that outlives the context (such as bundled
+// sources), without copying it if the engine allows
+JSValueRef evaluate_script_utf16(JSContextRef ctx, const JSChar *script, size_t len, char *source);
+
 char *value_to_c_string(JSContextRef ctx, JSValueRef val);
 
 JSValueRef c_string_to_value(JSContextRef ctx, const char *s);
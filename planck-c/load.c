@@ -0,0 +1,86 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "archive.h"
+#include "bundle.h"
+#include "classpath.h"
+#include "globals.h"
+#include "io.h"
+#include "load.h"
+#include "str.h"
+
+char *load_contents(char *path, time_t *last_modified, char **loaded_path) {
+    // Files under out/ aren't tracked by the classpath index, so
+    // misses are only remembered when there is no out/
+    bool cache_misses = config.out_path == NULL;
+    if (cache_misses && classpath_known_missing(path)) {
+        return NULL;
+    }
+
+    char *contents = NULL;
+    *last_modified = 0;
+    *loaded_path = strdup(path);
+
+    bool developing = (config.num_src_paths == 1 &&
+                       strcmp(config.src_paths[0].type, "src") == 0 &&
+                       str_has_suffix(config.src_paths[0].path, "/planck-cljs/src/") == 0);
+
+    if (!developing) {
+        contents = bundle_get_contents(path);
+        *last_modified = 0;
+    }
+
+    // load from classpath, retrying once with a fresh index if the file
+    // the index has for path has gone away
+    for (int attempt = 0; contents == NULL && attempt < 2; attempt++) {
+        int i = classpath_lookup(path);
+        if (i == -1) {
+            break;
+        }
+
+        char *type = config.src_paths[i].type;
+        char *location = config.src_paths[i].path;
+
+        if (strcmp(type, "src") == 0) {
+            char *full_path = str_concat(location, path);
+            contents = get_contents(full_path, last_modified);
+            if (contents != NULL) {
+                free(*loaded_path);
+                *loaded_path = strdup(full_path);
+            }
+            free(full_path);
+        } else if (strcmp(type, "jar") == 0) {
+            contents = get_contents_zip(location, path, last_modified);
+        }
+
+        if (contents == NULL) {
+            classpath_invalidate();
+        }
+    }
+
+    // load from out/
+    if (contents == NULL) {
+        if (config.out_path != NULL) {
+            char *full_path = str_concat(config.out_path, path);
+            contents = get_contents(full_path, last_modified);
+            free(full_path);
+        }
+    }
+
+    if (developing && contents == NULL) {
+        contents = bundle_get_contents(path);
+        *last_modified = 0;
+    }
+
+    if (contents == NULL) {
+        free(*loaded_path);
+        *loaded_path = NULL;
+        if (cache_misses) {
+            classpath_note_missing(path);
+        }
+    }
+
+    return contents;
+}
@@ -0,0 +1,7 @@
+#include <time.h>
+
+// Loads path (relative to the classpath) as PLANCK_LOAD does, from the bundle,
+// the classpath or out/. Returns the contents, or NULL if path can't be found,
+// setting last_modified (0 for bundled files) and loaded_path (to the path
+// of the file the contents came from, which the caller frees).
+char *load_contents(char *path, time_t *last_modified, char **loaded_path);
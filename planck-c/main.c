@@ -8,14 +8,35 @@
 #include <unistd.h>
 
 #include "bundle.h"
+#include "cache_prune.h"
+#include "classpath.h"
 #include "cljs.h"
 #include "globals.h"
 #include "io.h"
 #include "legal.h"
+#include "precompile.h"
+#include "preload.h"
 #include "repl.h"
 #include "str.h"
 #include "theme.h"
 #include "timers.h"
+#include "trace.h"
+#include "watch.h"
+
+// Values for options having no short form
+enum {
+    OPT_STARTUP_TRACE = 256,
+    OPT_AUTO_RELOAD,
+    OPT_CACHE_PACK,
+    OPT_SHARED_CACHE,
+    OPT_CACHE_MAX_SIZE,
+    OPT_CACHE_MAX_AGE,
+    OPT_CACHE_PRUNE,
+    OPT_PRECOMPILE
+};
+
+#define DEFAULT_CACHE_MAX_SIZE_MB 512
+#define DEFAULT_CACHE_MAX_AGE_DAYS 30
 
 void usage(char *program_name) {
     printf("\n");
@@ -31,6 +52,17 @@ void usage(char *program_name) {
     printf("                             JARs. PLANCK_CLASSPATH env var may be used instead.\n");
     printf("    -K, --auto-cache         Create and use .planck_cache dir for cache\n");
     printf("    -k path, --cache=path    If dir exists at path, use it for cache\n");
+    printf("    --cache-pack             Keep the cache in a single pack file in the cache\n");
+    printf("                             dir rather than in a file per artifact\n");
+    printf("    --shared-cache           Cache namespaces from JARs in a cache shared by\n");
+    printf("                             all projects ($XDG_CACHE_HOME/planck)\n");
+    printf("    --cache-max-size=mb      Evict the least recently used cache entries\n");
+    printf("                             beyond mb megabytes, daily on exit (%d for\n",
+           DEFAULT_CACHE_MAX_SIZE_MB);
+    printf("                             --cache-prune without limits)\n");
+    printf("    --cache-max-age=days     Evict cache entries unused for days, daily on\n");
+    printf("                             exit (%d for --cache-prune without limits)\n",
+           DEFAULT_CACHE_MAX_AGE_DAYS);
     printf("    -q, --quiet              Quiet mode\n");
     printf("    -v, --verbose            Emit verbose diagnostic output\n");
     printf("    -d, --dumb-terminal      Disable line editing / VT100 terminal control\n");
@@ -38,11 +70,18 @@ void usage(char *program_name) {
     printf("    -n x, --socket-repl=x    Enable socket REPL where x is port or IP:port\n");
     printf("    -s, --static-fns         Generate static dispatch function calls\n");
     printf("    -a, --elide-asserts      Set *assert* to false to remove asserts\n");
+    printf("    --startup-trace=path     Write a Chrome trace of startup phases to path\n");
+    printf("    --auto-reload            In a REPL, reload changed source files and their\n");
+    printf("                             dependents before each evaluation\n");
     printf("\n");
     printf("  main options:\n");
     printf("    -m ns-name, --main=ns-name Call the -main function from a namespace with\n");
     printf("                               args\n");
     printf("    -r, --repl                 Run a repl\n");
+    printf("    --cache-prune              Prune the cache to its limits and exit\n");
+    printf("    --precompile [ns ...|--all] Compile namespaces on the classpath (and what\n");
+    printf("                               they require) into the cache, in parallel,\n");
+    printf("                               without running them, and exit\n");
     // printf("    path                       Run a script from a file or resource\n");
     // printf("    -                          Run a script from standard input\n");
     printf("    -h, -?, --help             Print this help message and exit\n");
@@ -149,6 +188,51 @@ void init_classpath(char *classpath) {
     free(cwd);
 }
 
+void print_bundle_cache_stats(void) {
+    unsigned long hits = 0;
+    unsigned long misses = 0;
+    bundle_cache_stats(&hits, &misses);
+    fprintf(stderr, "Bundle cache: %lu hits, %lu misses\n", hits, misses);
+}
+
+// Does the startup work that doesn't need the engine, while it initializes
+void preload() {
+    trace_begin("startup", "preload");
+
+    if (config.cache_path) {
+        if (access(config.cache_path, W_OK) != 0) {
+            fprintf(stderr, "Warning: Unable to write to cache directory.\n\n");
+        }
+    }
+
+    if (config.shared_cache_path) {
+        if (access(config.shared_cache_path, W_OK) != 0) {
+            fprintf(stderr, "Warning: Unable to write to shared cache directory.\n\n");
+        }
+    }
+
+    for (int i = 0; i < config.num_scripts; i++) {
+        if (strcmp(config.scripts[i].type, "path") == 0) {
+            preload_file(config.scripts[i].source);
+        }
+    }
+
+    if (config.main_ns_name == NULL && !config.repl && config.num_rest_args > 0 &&
+        strcmp(config.rest_args[0], "-") != 0) {
+        preload_file(config.rest_args[0]);
+    }
+
+    preload_classpath();
+
+    classpath_index();
+
+    if (config.repl && !config.dumb_terminal) {
+        repl_load_line_editing();
+    }
+
+    trace_end("startup", "preload");
+}
+
 void print_usage_error(char* error_message, char *program_name)
 {
     printf("%s: %s", program_name, error_message);
@@ -159,6 +243,34 @@ void err_cache_path(char *program_name) {
     print_usage_error("At most one of -k/--cache or -K/--auto-cache may be specified.", program_name);
 }
 
+// The cache shared by all projects, under the user's cache directory,
+// created if need be. Returns NULL if there isn't one.
+char *shared_cache_path() {
+    char *base = NULL;
+    char *xdg_cache_home = getenv("XDG_CACHE_HOME");
+    if (xdg_cache_home != NULL && xdg_cache_home[0] == '/') {
+        base = strdup(xdg_cache_home);
+    } else {
+        char *home = getenv("HOME");
+        if (home == NULL) {
+            fprintf(stderr, "Warning: Unable to locate the shared cache; HOME is not set.\n\n");
+            return NULL;
+        }
+        base = str_concat(home, "/.cache");
+    }
+
+    char *path = str_concat(base, "/planck");
+    free(base);
+
+    if (mkdir_p(path) < 0) {
+        fprintf(stderr, "Could not create %s: %s\n", path, strerror(errno));
+        free(path);
+        return NULL;
+    }
+
+    return path;
+}
+
 int main(int argc, char **argv) {
     config.verbose = false;
     config.quiet = false;
@@ -167,8 +279,13 @@ int main(int argc, char **argv) {
     config.static_fns = false;
     config.elide_asserts = false;
     config.cache_path = NULL;
+    config.cache_pack = false;
+    config.shared_cache_path = NULL;
+    config.cache_max_size = 0;
+    config.cache_max_age = 0;
     config.theme = NULL;
     config.dumb_terminal = false;
+    config.auto_reload = false;
 
     config.out_path = NULL;
     config.num_src_paths = 0;
@@ -198,6 +315,14 @@ int main(int argc, char **argv) {
             {"auto-cache",    no_argument,       NULL, 'K'},
             {"init",          required_argument, NULL, 'i'},
             {"main",          required_argument, NULL, 'm'},
+            {"startup-trace", required_argument, NULL, OPT_STARTUP_TRACE},
+            {"auto-reload",   no_argument,       NULL, OPT_AUTO_RELOAD},
+            {"cache-pack",    no_argument,       NULL, OPT_CACHE_PACK},
+            {"shared-cache",  no_argument,       NULL, OPT_SHARED_CACHE},
+            {"cache-max-size", required_argument, NULL, OPT_CACHE_MAX_SIZE},
+            {"cache-max-age", required_argument, NULL, OPT_CACHE_MAX_AGE},
+            {"cache-prune",   no_argument,       NULL, OPT_CACHE_PRUNE},
+            {"precompile",    no_argument,       NULL, OPT_PRECOMPILE},
 
             // development options
             {"javascript",    no_argument,       NULL, 'j'},
@@ -207,6 +332,10 @@ int main(int argc, char **argv) {
     };
     int opt, option_index;
     bool did_encounter_main_opt = false;
+    bool shared_cache = false;
+    bool cache_prune = false;
+    bool cache_limits = false;
+    bool precompile_mode = false;
     while (!did_encounter_main_opt &&
            (opt = getopt_long(argc, argv, "h?lvrsak:je:t:n:dc:o:Ki:qm:", long_options, &option_index)) != -1) {
         switch (opt) {
@@ -297,6 +426,42 @@ int main(int argc, char **argv) {
             case 'o':
                 config.out_path = ensure_trailing_slash(strdup(optarg));
                 break;
+            case OPT_STARTUP_TRACE:
+                trace_init(strdup(optarg));
+                break;
+            case OPT_AUTO_RELOAD:
+                config.auto_reload = true;
+                break;
+            case OPT_CACHE_PACK:
+                config.cache_pack = true;
+                break;
+            case OPT_SHARED_CACHE:
+                shared_cache = true;
+                break;
+            case OPT_CACHE_MAX_SIZE:
+            case OPT_CACHE_MAX_AGE: {
+                char *end = NULL;
+                unsigned long limit = strtoul(optarg, &end, 10);
+                if (end == optarg || *end != '\0') {
+                    print_usage_error("Cache limits must be whole numbers.", argv[0]);
+                    return EXIT_FAILURE;
+                }
+                cache_limits = true;
+                if (opt == OPT_CACHE_MAX_SIZE) {
+                    config.cache_max_size = limit * 1024ULL * 1024ULL;
+                } else {
+                    config.cache_max_age = (long) limit * 24L * 60L * 60L;
+                }
+                break;
+            }
+            case OPT_CACHE_PRUNE:
+                did_encounter_main_opt = true;
+                cache_prune = true;
+                break;
+            case OPT_PRECOMPILE:
+                did_encounter_main_opt = true;
+                precompile_mode = true;
+                break;
             case '?':
                 usage(argv[0]);
                 exit(1);
@@ -305,10 +470,43 @@ int main(int argc, char **argv) {
         }
     }
 
-    if (config.cache_path) {
-        if (access(config.cache_path, W_OK) != 0) {
-            fprintf(stderr, "Warning: Unable to write to cache directory.\n\n");
+    if (config.verbose) {
+        atexit(print_bundle_cache_stats);
+    }
+
+    if (shared_cache) {
+        if (config.cache_path == NULL) {
+            fprintf(stderr, "Warning: --shared-cache requires a cache dir (-k or -K); ignored.\n\n");
+        } else {
+            config.shared_cache_path = shared_cache_path();
+        }
+    }
+
+    // The pack is bounded by its own compaction
+    if ((cache_prune || cache_limits) && config.cache_pack) {
+        print_usage_error("Cache limits and --cache-prune don't apply to --cache-pack.", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (cache_prune) {
+        if (config.cache_path == NULL) {
+            print_usage_error("--cache-prune requires a cache dir (-k or -K).", argv[0]);
+            return EXIT_FAILURE;
+        }
+        if (!cache_limits) {
+            config.cache_max_size = DEFAULT_CACHE_MAX_SIZE_MB * 1024ULL * 1024ULL;
+            config.cache_max_age = DEFAULT_CACHE_MAX_AGE_DAYS * 24L * 60L * 60L;
         }
+        cache_prune_all(true);
+        return EXIT_SUCCESS;
+    }
+
+    // Only pruned as a matter of course if asked to, as the cache directory
+    // may hold the user's own files
+    if (config.cache_path && cache_limits) {
+        // Registered before anything writes to the cache, so that it runs
+        // after the pending writes are flushed
+        atexit(cache_prune_if_due);
     }
 
     if (config.num_src_paths == 0) {
@@ -337,6 +535,15 @@ int main(int argc, char **argv) {
         }
     }
 
+    if (precompile_mode) {
+        if (config.cache_path == NULL) {
+            print_usage_error("--precompile requires a cache dir (-k or -K).", argv[0]);
+            return EXIT_FAILURE;
+        }
+        bool all = config.num_rest_args == 1 && strcmp(config.rest_args[0], "--all") == 0;
+        return precompile(all ? 0 : config.num_rest_args, config.rest_args);
+    }
+
     if (config.num_scripts == 0 && config.main_ns_name == NULL && config.num_rest_args == 0) {
         config.repl = true;
     }
@@ -352,10 +559,18 @@ int main(int argc, char **argv) {
 
     config.is_tty = isatty(STDIN_FILENO) == 1;
 
+    // Settled before the engine thread, which reads it, is started
+    if (config.repl && config.auto_reload && !watch_start()) {
+        fprintf(stderr, "Warning: Unable to watch source directories; --auto-reload disabled.\n\n");
+        config.auto_reload = false;
+    }
+
     JSGlobalContextRef ctx = JSGlobalContextCreate(NULL);
     global_ctx = ctx;
     cljs_engine_init(ctx);
 
+    preload();
+
     // Process init arguments
 
     for (int i = 0; i < config.num_scripts; i++) {
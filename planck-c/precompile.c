@@ -0,0 +1,576 @@
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <JavaScriptCore/JavaScript.h>
+
+#include "cache_writer.h"
+#include "classpath.h"
+#include "cljs.h"
+#include "globals.h"
+#include "jsc_utils.h"
+#include "precompile.h"
+#include "repl.h"
+#include "str.h"
+
+// Precompiling forks a pool of worker processes, each booting its own
+// engine, and hands them namespaces to compile in dependency order: a
+// namespace once everything it requires on the classpath has been
+// compiled, so that workers find what they require in the cache rather
+// than compiling it again (or waiting on the worker that is, see
+// cache_lock.h). Namespaces that don't depend on each other compile in
+// parallel. The parent doesn't boot an engine itself, as the threads of
+// one don't survive fork(2).
+//
+// The first worker is first asked for the plan: the namespaces defined by
+// the source files on the classpath, and what each requires. The parent
+// talks to each worker over a pair of pipes, a line per request:
+//
+//   plan <path>...   answered by "<ns> <required-ns>..." for each
+//                    namespace, then "."
+//   compile <ns>     answered by "ok" or "error <message>"
+//
+// A worker exits when its request pipe is closed.
+
+#define PRECOMPILE_MAX_WORKERS 16
+
+enum node_state {
+    NODE_PENDING,
+    NODE_READY,
+    NODE_RUNNING,
+    NODE_DONE
+};
+
+struct node {
+    char *name;
+    size_t num_requires;
+    char **requires;
+    // Indices of the nodes requiring this one
+    size_t num_dependents;
+    size_t *dependents;
+    // Requires not yet compiled
+    size_t waiting;
+    bool wanted;
+    enum node_state state;
+};
+
+struct worker {
+    pid_t pid;
+    FILE *requests;
+    FILE *responses;
+    // The node being compiled, or -1
+    long node;
+    bool alive;
+};
+
+static struct node *nodes = NULL;
+static size_t num_nodes = 0;
+
+// Node indices by name, open-addressed
+static long *node_table = NULL;
+static size_t node_capacity = 0;
+
+static long *node_slot(const char *name) {
+    size_t mask = node_capacity - 1;
+    size_t i = str_hash(name) & mask;
+    while (node_table[i] != -1 && strcmp(nodes[node_table[i]].name, name) != 0) {
+        i = (i + 1) & mask;
+    }
+    return &node_table[i];
+}
+
+static long node_find(const char *name) {
+    return node_capacity == 0 ? -1 : *node_slot(name);
+}
+
+static void index_nodes() {
+    node_capacity = 16;
+    while (node_capacity < 2 * num_nodes) {
+        node_capacity *= 2;
+    }
+    node_table = malloc(node_capacity * sizeof(long));
+    for (size_t i = 0; i < node_capacity; i++) {
+        node_table[i] = -1;
+    }
+    for (size_t i = 0; i < num_nodes; i++) {
+        long *slot = node_slot(nodes[i].name);
+        if (*slot == -1) {
+            *slot = (long) i;
+        }
+    }
+}
+
+// Splits line in place at spaces
+static char **split_words(char *line, size_t *count) {
+    size_t capacity = 8;
+    char **words = malloc(capacity * sizeof(char *));
+    *count = 0;
+    for (char *word = strtok(line, " "); word != NULL; word = strtok(NULL, " ")) {
+        if (*count == capacity) {
+            capacity *= 2;
+            words = realloc(words, capacity * sizeof(char *));
+        }
+        words[(*count)++] = word;
+    }
+    return words;
+}
+
+static void chomp(char *line) {
+    size_t len = strlen(line);
+    if (len > 0 && line[len - 1] == '\n') {
+        line[len - 1] = '\0';
+    }
+}
+
+// Worker
+
+static void worker_plan(JSContextRef ctx, char **paths, size_t num_paths, FILE *out) {
+    JSValueRef *values = malloc((num_paths + 1) * sizeof(JSValueRef));
+    for (size_t i = 0; i < num_paths; i++) {
+        values[i] = c_string_to_value(ctx, paths[i]);
+    }
+    JSValueRef args[1];
+    args[0] = JSObjectMakeArray(ctx, num_paths, values, NULL);
+    free(values);
+
+    JSValueRef plan = JSObjectCallAsFunction(ctx, get_function(ctx, "planck.repl", "precompile-plan"),
+                                             JSContextGetGlobalObject(ctx), 1, args, NULL);
+    if (plan != NULL && JSValueIsObject(ctx, plan)) {
+        JSObjectRef plan_obj = JSValueToObject(ctx, plan, NULL);
+        int count = array_get_count(ctx, plan_obj);
+        for (int i = 0; i < count; i++) {
+            char *node = value_to_c_string(ctx, array_get_value_at_index(ctx, plan_obj, i));
+            if (node != NULL) {
+                fprintf(out, "%s\n", node);
+                free(node);
+            }
+        }
+    }
+    fprintf(out, ".\n");
+}
+
+static void worker_compile(JSContextRef ctx, char *ns, FILE *out) {
+    JSValueRef args[1];
+    args[0] = c_string_to_value(ctx, ns);
+
+    JSValueRef ex = NULL;
+    JSValueRef error = JSObjectCallAsFunction(ctx, get_function(ctx, "planck.repl", "precompile-ns"),
+                                              JSContextGetGlobalObject(ctx), 1, args, &ex);
+    char *message = NULL;
+    if (ex != NULL) {
+        message = value_to_c_string(ctx, ex);
+    } else if (error != NULL && JSValueIsString(ctx, error)) {
+        message = value_to_c_string(ctx, error);
+    }
+
+    if (message == NULL) {
+        fprintf(out, "ok\n");
+    } else {
+        for (char *c = message; *c != '\0'; c++) {
+            if (*c == '\n') {
+                *c = ' ';
+            }
+        }
+        fprintf(out, "error %s\n", message);
+        free(message);
+    }
+}
+
+static void run_worker(int request_fd, int response_fd) {
+    JSGlobalContextRef ctx = JSGlobalContextCreate(NULL);
+    global_ctx = ctx;
+    cljs_engine_init(ctx);
+    block_until_engine_ready();
+
+    FILE *in = fdopen(request_fd, "r");
+    FILE *out = fdopen(response_fd, "w");
+
+    char *line = NULL;
+    size_t line_cap = 0;
+    while (getline(&line, &line_cap, in) > 0) {
+        chomp(line);
+        size_t num_words = 0;
+        char **words = split_words(line, &num_words);
+        if (num_words > 0 && strcmp(words[0], "plan") == 0) {
+            worker_plan(ctx, words + 1, num_words - 1, out);
+        } else if (num_words == 2 && strcmp(words[0], "compile") == 0) {
+            worker_compile(ctx, words[1], out);
+        }
+        free(words);
+        fflush(out);
+    }
+
+    // Skipping the parent's exit handlers, but not the cache writes
+    cache_writer_flush();
+    _exit(EXIT_SUCCESS);
+}
+
+// Starts workers[index], the workers before it having been started
+static bool start_worker(struct worker *workers, int index) {
+    struct worker *worker = &workers[index];
+    int requests[2];
+    int responses[2];
+    if (pipe(requests) != 0) {
+        return false;
+    }
+    if (pipe(responses) != 0) {
+        close(requests[0]);
+        close(requests[1]);
+        return false;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == -1) {
+        close(requests[0]);
+        close(requests[1]);
+        close(responses[0]);
+        close(responses[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        // Holding the other workers' pipes open would keep them from
+        // seeing their requests end
+        for (int i = 0; i < index; i++) {
+            close(fileno(workers[i].requests));
+            close(fileno(workers[i].responses));
+        }
+        close(requests[1]);
+        close(responses[0]);
+        run_worker(requests[0], responses[1]);
+    }
+
+    close(requests[0]);
+    close(responses[1]);
+    worker->pid = pid;
+    worker->requests = fdopen(requests[1], "w");
+    worker->responses = fdopen(responses[0], "r");
+    worker->node = -1;
+    worker->alive = true;
+    return true;
+}
+
+static void stop_worker(struct worker *worker) {
+    if (worker->requests != NULL) {
+        fclose(worker->requests);
+        worker->requests = NULL;
+    }
+    if (worker->responses != NULL) {
+        fclose(worker->responses);
+        worker->responses = NULL;
+    }
+    worker->alive = false;
+}
+
+// Planning
+
+static bool is_source_path(char *path) {
+    return str_has_suffix(path, ".cljs") == 0 || str_has_suffix(path, ".cljc") == 0;
+}
+
+static bool read_plan(struct worker *worker) {
+    size_t num_paths = 0;
+    char **paths = classpath_paths(&num_paths);
+
+    fprintf(worker->requests, "plan");
+    for (size_t i = 0; i < num_paths; i++) {
+        // Paths having spaces can't be named in a request (nor be a
+        // namespace's source)
+        if (is_source_path(paths[i]) && strchr(paths[i], ' ') == NULL) {
+            fprintf(worker->requests, " %s", paths[i]);
+        }
+        free(paths[i]);
+    }
+    free(paths);
+    fprintf(worker->requests, "\n");
+    if (fflush(worker->requests) != 0) {
+        return false;
+    }
+
+    size_t capacity = 64;
+    nodes = malloc(capacity * sizeof(struct node));
+
+    char *line = NULL;
+    size_t line_cap = 0;
+    bool complete = false;
+    while (getline(&line, &line_cap, worker->responses) > 0) {
+        chomp(line);
+        if (strcmp(line, ".") == 0) {
+            complete = true;
+            break;
+        }
+
+        size_t num_words = 0;
+        char **words = split_words(line, &num_words);
+        if (num_words > 0) {
+            if (num_nodes == capacity) {
+                capacity *= 2;
+                nodes = realloc(nodes, capacity * sizeof(struct node));
+            }
+            struct node *node = &nodes[num_nodes++];
+            memset(node, 0, sizeof(struct node));
+            node->name = strdup(words[0]);
+            node->num_requires = num_words - 1;
+            node->requires = malloc((num_words > 1 ? num_words - 1 : 1) * sizeof(char *));
+            for (size_t i = 1; i < num_words; i++) {
+                node->requires[i - 1] = strdup(words[i]);
+            }
+        }
+        free(words);
+    }
+    free(line);
+
+    return complete;
+}
+
+// Marks the node at i wanted, along with what it requires
+static void want(long i) {
+    if (nodes[i].wanted) {
+        return;
+    }
+    nodes[i].wanted = true;
+    for (size_t j = 0; j < nodes[i].num_requires; j++) {
+        long required = node_find(nodes[i].requires[j]);
+        if (required != -1) {
+            want(required);
+        }
+    }
+}
+
+// Links the wanted nodes to those they require, returning how many are
+// wanted
+static size_t link_nodes() {
+    size_t num_wanted = 0;
+    for (size_t i = 0; i < num_nodes; i++) {
+        if (!nodes[i].wanted) {
+            continue;
+        }
+        num_wanted++;
+        for (size_t j = 0; j < nodes[i].num_requires; j++) {
+            long required = node_find(nodes[i].requires[j]);
+            if (required != -1 && required != (long) i) {
+                struct node *node = &nodes[required];
+                node->dependents = realloc(node->dependents, (node->num_dependents + 1) * sizeof(size_t));
+                node->dependents[node->num_dependents++] = i;
+                nodes[i].waiting++;
+            }
+        }
+    }
+    return num_wanted;
+}
+
+// Scheduling
+
+static size_t *ready = NULL;
+static size_t ready_head = 0;
+static size_t ready_tail = 0;
+
+static void make_ready(size_t i) {
+    nodes[i].state = NODE_READY;
+    ready[ready_tail++] = i;
+}
+
+static void complete_node(size_t i) {
+    nodes[i].state = NODE_DONE;
+    for (size_t j = 0; j < nodes[i].num_dependents; j++) {
+        struct node *dependent = &nodes[nodes[i].dependents[j]];
+        if (--dependent->waiting == 0 && dependent->state == NODE_PENDING) {
+            make_ready(nodes[i].dependents[j]);
+        }
+    }
+}
+
+// Should the namespaces left require each other in a cycle, makes ready
+// the one among them waiting on the fewest others, the rest following as
+// usual as it completes. Returns false if there is none.
+static bool break_cycle() {
+    long best = -1;
+    for (size_t i = 0; i < num_nodes; i++) {
+        if (nodes[i].wanted && nodes[i].state == NODE_PENDING &&
+            (best == -1 || nodes[i].waiting < nodes[best].waiting)) {
+            best = (long) i;
+        }
+    }
+    if (best == -1) {
+        return false;
+    }
+    if (config.verbose) {
+        fprintf(stderr, "Compiling %s ahead of what it requires, as part of a cycle\n", nodes[best].name);
+    }
+    make_ready((size_t) best);
+    return true;
+}
+
+static int num_workers_to_start() {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_cpus < 1) {
+        num_cpus = 1;
+    }
+    return num_cpus > PRECOMPILE_MAX_WORKERS ? PRECOMPILE_MAX_WORKERS : (int) num_cpus;
+}
+
+int precompile(size_t num_names, char **names) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Workers that die are noticed by their pipes closing
+    signal(SIGPIPE, SIG_IGN);
+
+    int num_workers = num_workers_to_start();
+    struct worker workers[PRECOMPILE_MAX_WORKERS];
+    int num_started = 0;
+    for (int i = 0; i < num_workers; i++) {
+        if (start_worker(workers, num_started)) {
+            num_started++;
+        }
+    }
+    if (num_started == 0) {
+        fprintf(stderr, "Could not start precompiling: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    int rv = EXIT_SUCCESS;
+
+    if (!read_plan(&workers[0])) {
+        fprintf(stderr, "Could not determine the namespaces to precompile.\n");
+        rv = EXIT_FAILURE;
+        num_nodes = 0;
+    }
+    index_nodes();
+
+    if (num_names == 0) {
+        for (size_t i = 0; i < num_nodes; i++) {
+            want((long) i);
+        }
+    } else {
+        for (size_t i = 0; i < num_names; i++) {
+            long node = node_find(names[i]);
+            if (node == -1) {
+                fprintf(stderr, "Could not find source for %s on the classpath.\n", names[i]);
+                rv = EXIT_FAILURE;
+            } else {
+                want(node);
+            }
+        }
+    }
+
+    size_t num_wanted = link_nodes();
+    ready = malloc((num_nodes + 1) * sizeof(size_t));
+    for (size_t i = 0; i < num_nodes; i++) {
+        if (nodes[i].wanted && nodes[i].waiting == 0) {
+            make_ready(i);
+        }
+    }
+
+    size_t num_done = 0;
+    size_t num_failed = 0;
+    size_t num_running = 0;
+    int num_alive = num_started;
+    while (num_done < num_wanted && num_alive > 0) {
+        if (ready_head == ready_tail && num_running == 0 && !break_cycle()) {
+            break;
+        }
+
+        // Hand out what is ready to idle workers
+        for (int w = 0; w < num_started && ready_head < ready_tail; w++) {
+            struct worker *worker = &workers[w];
+            if (worker->alive && worker->node == -1) {
+                size_t i = ready[ready_head++];
+                nodes[i].state = NODE_RUNNING;
+                worker->node = (long) i;
+                num_running++;
+                if (config.verbose) {
+                    fprintf(stderr, "Compiling %s\n", nodes[i].name);
+                }
+                fprintf(worker->requests, "compile %s\n", nodes[i].name);
+                fflush(worker->requests);
+            }
+        }
+
+        struct pollfd fds[PRECOMPILE_MAX_WORKERS];
+        int fd_workers[PRECOMPILE_MAX_WORKERS];
+        int num_fds = 0;
+        for (int w = 0; w < num_started; w++) {
+            if (workers[w].alive && workers[w].node != -1) {
+                fds[num_fds].fd = fileno(workers[w].responses);
+                fds[num_fds].events = POLLIN;
+                fds[num_fds].revents = 0;
+                fd_workers[num_fds++] = w;
+            }
+        }
+        if (poll(fds, (nfds_t) num_fds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        for (int f = 0; f < num_fds; f++) {
+            if (fds[f].revents == 0) {
+                continue;
+            }
+
+            struct worker *worker = &workers[fd_workers[f]];
+            size_t i = (size_t) worker->node;
+            worker->node = -1;
+            num_running--;
+            num_done++;
+
+            char *line = NULL;
+            size_t line_cap = 0;
+            if (getline(&line, &line_cap, worker->responses) <= 0) {
+                fprintf(stderr, "Could not compile %s: worker exited\n", nodes[i].name);
+                num_failed++;
+                stop_worker(worker);
+                num_alive--;
+            } else {
+                chomp(line);
+                if (str_has_prefix(line, "error") == 0) {
+                    fprintf(stderr, "Could not compile %s: %s\n", nodes[i].name,
+                            line[5] == ' ' ? line + 6 : "unknown error");
+                    num_failed++;
+                }
+            }
+            free(line);
+
+            // Dependents of a namespace that failed are still attempted,
+            // reporting their own failures
+            complete_node(i);
+        }
+    }
+
+    if (num_done < num_wanted) {
+        fprintf(stderr, "Could not compile %zu namespaces: no workers left\n", num_wanted - num_done);
+        num_failed += num_wanted - num_done;
+    }
+
+    for (int w = 0; w < num_started; w++) {
+        stop_worker(&workers[w]);
+    }
+    for (int w = 0; w < num_started; w++) {
+        waitpid(workers[w].pid, NULL, 0);
+    }
+
+    if (!config.quiet) {
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("Precompiled %zu namespaces with %d workers in %.1fs\n", num_wanted - num_failed, num_started,
+               elapsed);
+    }
+
+    if (num_failed > 0) {
+        rv = EXIT_FAILURE;
+    }
+
+    return rv;
+}
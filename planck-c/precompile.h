@@ -0,0 +1,10 @@
+// Ahead-of-time compilation of the namespaces on the classpath into the
+// cache, in parallel (see --precompile)
+
+#include <stddef.h>
+
+// Compiles the namespaces named (or, if num_names is 0, every namespace
+// defined in source on the classpath), along with those on the classpath
+// they require, into the cache without running them. Returns an exit
+// status.
+int precompile(size_t num_names, char **names);
@@ -0,0 +1,354 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "cache_pack.h"
+#include "io.h"
+#include "load.h"
+#include "prefetch.h"
+#include "str.h"
+
+// When a namespace is loaded, the files for the namespaces it requires are
+// queued here, so that they are read (and, for JARs, inflated) while the
+// engine is busy evaluating it. Each result is handed out once, by the
+// PLANCK_LOAD or PLANCK_READ_FILE call that wanted it.
+//
+// Items are found by path in an open-addressed hash table, and are also on
+// one of two lists, in the order queued: those waiting for a worker, and
+// those being read or done. Results that are never asked for (the requiring
+// code may already be cached, say) are dropped, oldest first, to keep within
+// the limits below.
+//
+// A result read from a file is only handed out if the file hasn't been
+// modified since it was read: its modification time, size and inode must be
+// as they were, and its modification time must predate the read by more
+// than the file system's timestamps can lag (so that a write racing the
+// read isn't missed). Results that can't be checked this way (entries of
+// JARs, say) are only trusted for a few seconds, and failures to find a
+// file aren't trusted at all, as it may have been written since.
+
+#define PREFETCH_NUM_THREADS 4
+#define PREFETCH_MAX_ITEMS 1024
+#define PREFETCH_MAX_BYTES (32 * 1024 * 1024)
+#define PREFETCH_MAX_AGE 5
+#define PREFETCH_MTIME_SLACK_NS 50000000LL
+
+enum prefetch_state {
+    PREFETCH_QUEUED,
+    PREFETCH_RUNNING,
+    PREFETCH_DONE
+};
+
+struct prefetch_list {
+    struct prefetch_item *head;
+    struct prefetch_item *tail;
+};
+
+struct prefetch_item {
+    bool is_file;
+    char *path;
+    unsigned int hash;
+    enum prefetch_state state;
+    char *contents;
+    size_t size;
+    time_t last_modified;
+    char *loaded_path;
+    time_t done;
+    // The file read, as it was, if there was one
+    bool stamped;
+    long long read_ns;
+    long long mtime_ns;
+    off_t file_size;
+    ino_t ino;
+    struct prefetch_list *list;
+    struct prefetch_item *prev;
+    struct prefetch_item *next;
+};
+
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t prefetch_done = PTHREAD_COND_INITIALIZER;
+static bool prefetch_started = false;
+
+static struct prefetch_item **prefetch_table = NULL;
+static size_t prefetch_capacity = 0;
+
+static struct prefetch_list prefetch_waiting = {NULL, NULL};
+static struct prefetch_list prefetch_results = {NULL, NULL};
+static size_t prefetch_num_items = 0;
+static size_t prefetch_num_bytes = 0;
+
+static unsigned int prefetch_hash(bool is_file, const char *path) {
+    return str_hash(path) ^ (is_file ? 0x9e3779b9 : 0);
+}
+
+static size_t prefetch_slot(bool is_file, const char *path, unsigned int hash) {
+    size_t mask = prefetch_capacity - 1;
+    size_t i = hash & mask;
+    while (prefetch_table[i] != NULL &&
+           (prefetch_table[i]->is_file != is_file || strcmp(prefetch_table[i]->path, path) != 0)) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static struct prefetch_item *prefetch_find(bool is_file, char *path) {
+    if (prefetch_capacity == 0) {
+        return NULL;
+    }
+    return prefetch_table[prefetch_slot(is_file, path, prefetch_hash(is_file, path))];
+}
+
+static void prefetch_table_put(struct prefetch_item *item) {
+    // Keep the load factor under 1/2
+    if (2 * (prefetch_num_items + 1) > prefetch_capacity) {
+        struct prefetch_item **old_table = prefetch_table;
+        size_t old_capacity = prefetch_capacity;
+        prefetch_capacity = old_capacity == 0 ? 64 : 2 * old_capacity;
+        prefetch_table = calloc(prefetch_capacity, sizeof(struct prefetch_item *));
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old_table[i] != NULL) {
+                prefetch_table[prefetch_slot(old_table[i]->is_file, old_table[i]->path, old_table[i]->hash)] =
+                        old_table[i];
+            }
+        }
+        free(old_table);
+    }
+
+    prefetch_table[prefetch_slot(item->is_file, item->path, item->hash)] = item;
+}
+
+// Removes item from the table, moving back any items after it in its run
+// that would otherwise no longer be found
+static void prefetch_table_remove(struct prefetch_item *item) {
+    size_t mask = prefetch_capacity - 1;
+    size_t i = prefetch_slot(item->is_file, item->path, item->hash);
+    prefetch_table[i] = NULL;
+
+    for (size_t j = (i + 1) & mask; prefetch_table[j] != NULL; j = (j + 1) & mask) {
+        size_t home = prefetch_table[j]->hash & mask;
+        // Move the item at j to the hole at i unless its home lies
+        // cyclically in (i, j]
+        bool in_place = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+        if (!in_place) {
+            prefetch_table[i] = prefetch_table[j];
+            prefetch_table[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+static void prefetch_list_append(struct prefetch_list *list, struct prefetch_item *item) {
+    item->list = list;
+    item->prev = list->tail;
+    item->next = NULL;
+    if (list->tail != NULL) {
+        list->tail->next = item;
+    } else {
+        list->head = item;
+    }
+    list->tail = item;
+}
+
+static void prefetch_list_remove(struct prefetch_item *item) {
+    struct prefetch_list *list = item->list;
+    if (item->prev != NULL) {
+        item->prev->next = item->next;
+    } else {
+        list->head = item->next;
+    }
+    if (item->next != NULL) {
+        item->next->prev = item->prev;
+    } else {
+        list->tail = item->prev;
+    }
+    item->list = NULL;
+    item->prev = NULL;
+    item->next = NULL;
+}
+
+static void prefetch_free(struct prefetch_item *item) {
+    free(item->path);
+    free(item->contents);
+    free(item->loaded_path);
+    free(item);
+}
+
+static void prefetch_unlink(struct prefetch_item *item) {
+    prefetch_table_remove(item);
+    prefetch_list_remove(item);
+    prefetch_num_items--;
+    prefetch_num_bytes -= item->size;
+}
+
+// Drops unclaimed results until within the limits. Called with prefetch_lock held.
+static void prefetch_evict() {
+    struct prefetch_item *item = prefetch_results.head;
+    while (item != NULL &&
+           (prefetch_num_items > PREFETCH_MAX_ITEMS || prefetch_num_bytes > PREFETCH_MAX_BYTES)) {
+        struct prefetch_item *next = item->next;
+        if (item->state == PREFETCH_DONE) {
+            prefetch_unlink(item);
+            prefetch_free(item);
+        }
+        item = next;
+    }
+}
+
+static long long prefetch_mtime_ns(struct stat *st) {
+#ifdef __APPLE__
+    return (long long) st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#else
+    return (long long) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+static long long prefetch_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (long long) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Whether the file item was read from is unchanged since
+static bool prefetch_current(struct prefetch_item *item) {
+    struct stat st;
+    return stat(item->is_file ? item->path : item->loaded_path, &st) == 0 &&
+           prefetch_mtime_ns(&st) == item->mtime_ns &&
+           st.st_size == item->file_size &&
+           st.st_ino == item->ino &&
+           item->mtime_ns < item->read_ns - PREFETCH_MTIME_SLACK_NS;
+}
+
+static void *prefetch_worker(void *data) {
+    pthread_mutex_lock(&prefetch_lock);
+    for (;;) {
+        struct prefetch_item *item = prefetch_waiting.head;
+        if (item == NULL) {
+            pthread_cond_wait(&prefetch_queued, &prefetch_lock);
+            continue;
+        }
+
+        prefetch_list_remove(item);
+        prefetch_list_append(&prefetch_results, item);
+        item->state = PREFETCH_RUNNING;
+        pthread_mutex_unlock(&prefetch_lock);
+
+        long long read_ns = prefetch_now_ns();
+        time_t last_modified = 0;
+        char *loaded_path = NULL;
+        char *contents;
+        if (item->is_file) {
+            contents = get_contents(item->path, &last_modified);
+        } else {
+            contents = load_contents(item->path, &last_modified, &loaded_path);
+        }
+
+        // Sources in directories are loaded from a path other than the one
+        // asked for; those in JARs, out/ and the bundle aren't
+        char *read_path = item->is_file ? item->path :
+                          loaded_path != NULL && strcmp(loaded_path, item->path) != 0 ? loaded_path : NULL;
+        struct stat st;
+        bool stamped = contents != NULL && read_path != NULL && stat(read_path, &st) == 0;
+
+        pthread_mutex_lock(&prefetch_lock);
+        item->state = PREFETCH_DONE;
+        item->contents = contents;
+        item->size = contents != NULL ? strlen(contents) : 0;
+        item->last_modified = last_modified;
+        item->loaded_path = loaded_path;
+        item->done = time(NULL);
+        item->stamped = stamped;
+        if (stamped) {
+            item->read_ns = read_ns;
+            item->mtime_ns = prefetch_mtime_ns(&st);
+            item->file_size = st.st_size;
+            item->ino = st.st_ino;
+        }
+        prefetch_num_bytes += item->size;
+        pthread_cond_broadcast(&prefetch_done);
+        prefetch_evict();
+    }
+    return NULL;
+}
+
+// Starts the pool on first use. Called with prefetch_lock held.
+static void prefetch_start() {
+    if (prefetch_started) {
+        return;
+    }
+    prefetch_started = true;
+
+    for (int i = 0; i < PREFETCH_NUM_THREADS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, prefetch_worker, NULL) == 0) {
+            pthread_detach(thread);
+        }
+    }
+}
+
+void prefetch(bool is_file, char *path) {
+    // The pack is mapped, so there is nothing to read ahead
+    if (is_file && cache_pack_owns(path)) {
+        return;
+    }
+
+    pthread_mutex_lock(&prefetch_lock);
+
+    if (prefetch_find(is_file, path) == NULL) {
+        prefetch_start();
+
+        struct prefetch_item *item = calloc(1, sizeof(struct prefetch_item));
+        item->is_file = is_file;
+        item->path = strdup(path);
+        item->hash = prefetch_hash(is_file, path);
+        item->state = PREFETCH_QUEUED;
+
+        prefetch_table_put(item);
+        prefetch_list_append(&prefetch_waiting, item);
+        prefetch_num_items++;
+
+        prefetch_evict();
+        pthread_cond_signal(&prefetch_queued);
+    }
+
+    pthread_mutex_unlock(&prefetch_lock);
+}
+
+bool get_prefetched(bool is_file, char *path, char **contents, time_t *last_modified, char **loaded_path) {
+    bool found = false;
+
+    pthread_mutex_lock(&prefetch_lock);
+
+    struct prefetch_item *item = prefetch_find(is_file, path);
+    while (item != NULL && item->state == PREFETCH_RUNNING) {
+        pthread_cond_wait(&prefetch_done, &prefetch_lock);
+        item = prefetch_find(is_file, path);
+    }
+
+    if (item != NULL) {
+        prefetch_unlink(item);
+    }
+
+    pthread_mutex_unlock(&prefetch_lock);
+
+    if (item != NULL) {
+        if (item->state == PREFETCH_DONE && item->contents != NULL &&
+            (item->stamped ? prefetch_current(item) : time(NULL) - item->done <= PREFETCH_MAX_AGE)) {
+            found = true;
+            *contents = item->contents;
+            item->contents = NULL;
+            *last_modified = item->last_modified;
+            if (loaded_path != NULL) {
+                *loaded_path = item->loaded_path;
+                item->loaded_path = NULL;
+            }
+        }
+        prefetch_free(item);
+    }
+
+    return found;
+}
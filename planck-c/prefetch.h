@@ -0,0 +1,18 @@
+// Reads files the loader is expected to ask for soon, on a small pool of
+// background threads
+
+#include <stdbool.h>
+#include <time.h>
+
+// Queues the reading of path: a path relative to the classpath (resolved as
+// by load_contents) or, if is_file, a file path (read with get_contents).
+// Paths already queued are ignored.
+void prefetch(bool is_file, char *path);
+
+// Takes the result of prefetching path, waiting for it if it is being read.
+// Returns false if path wasn't prefetched (or hadn't been started on, in which
+// case it is dequeued), couldn't be found, or may have changed since it was
+// read, and the caller should read it itself. Otherwise sets contents,
+// last_modified and, if non-NULL, loaded_path, ownership of which passes to
+// the caller.
+bool get_prefetched(bool is_file, char *path, char **contents, time_t *last_modified, char **loaded_path);
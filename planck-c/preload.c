@@ -0,0 +1,75 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "globals.h"
+#include "io.h"
+#include "preload.h"
+
+// The main thread would otherwise sit idle in block_until_engine_ready while
+// the engine boots, so it reads what the scripts it was given will need. The
+// engine thread picks the results up from here, hence the lock.
+
+struct preloaded_file {
+    char *path;
+    char *contents;
+    time_t last_modified;
+};
+
+static pthread_mutex_t preload_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct preloaded_file *preloaded_files = NULL;
+static size_t num_preloaded_files = 0;
+
+void preload_file(char *path) {
+    time_t last_modified = 0;
+    char *contents = get_contents(path, &last_modified);
+    if (contents == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&preload_lock);
+    preloaded_files = realloc(preloaded_files, (num_preloaded_files + 1) * sizeof(struct preloaded_file));
+    preloaded_files[num_preloaded_files].path = strdup(path);
+    preloaded_files[num_preloaded_files].contents = contents;
+    preloaded_files[num_preloaded_files].last_modified = last_modified;
+    num_preloaded_files++;
+    pthread_mutex_unlock(&preload_lock);
+}
+
+void preload_classpath(void) {
+#ifdef POSIX_FADV_WILLNEED
+    for (int i = 0; i < config.num_src_paths; i++) {
+        if (strcmp(config.src_paths[i].type, "jar") == 0) {
+            int fd = open(config.src_paths[i].path, O_RDONLY);
+            if (fd >= 0) {
+                posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+                close(fd);
+            }
+        }
+    }
+#endif
+}
+
+char *get_preloaded(char *path, time_t *last_modified) {
+    char *contents = NULL;
+
+    pthread_mutex_lock(&preload_lock);
+    for (size_t i = 0; i < num_preloaded_files; i++) {
+        if (strcmp(preloaded_files[i].path, path) == 0) {
+            contents = preloaded_files[i].contents;
+            if (last_modified != NULL) {
+                *last_modified = preloaded_files[i].last_modified;
+            }
+            free(preloaded_files[i].path);
+            preloaded_files[i] = preloaded_files[--num_preloaded_files];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&preload_lock);
+
+    return contents;
+}
@@ -0,0 +1,14 @@
+// Work done on the main thread while the engine initializes
+
+#include <time.h>
+
+// Reads the file at path ahead of time, for the next get_preloaded call
+void preload_file(char *path);
+
+// Hints to the OS that the classpath JARs will soon be read
+void preload_classpath(void);
+
+// Returns the contents of a preloaded file (ownership passes to the caller),
+// or NULL if path was not preloaded. Each preload is handed out only once, so
+// that subsequent reads see any changes to the file.
+char *get_preloaded(char *path, time_t *last_modified);
@@ -464,6 +464,29 @@ void *accept_connections(void *data) {
     return NULL;
 }
 
+static bool line_editing_loaded = false;
+static char *history_path = NULL;
+static int keymap_result = EXIT_SUCCESS;
+
+void repl_load_line_editing() {
+    if (line_editing_loaded) {
+        return;
+    }
+    line_editing_loaded = true;
+
+    char *home = getenv("HOME");
+    if (home != NULL) {
+        char history_name[] = ".planck_history";
+        size_t len = strlen(home) + strlen(history_name) + 2;
+        history_path = malloc(len * sizeof(char));
+        snprintf(history_path, len, "%s/%s", home, history_name);
+
+        linenoiseHistoryLoad(history_path);
+
+        keymap_result = load_keymap(home);
+    }
+}
+
 int run_repl(JSContextRef ctx) {
     repl_t *repl = make_repl();
     s_repl = repl;
@@ -476,19 +499,11 @@ int run_repl(JSContextRef ctx) {
     // Per-type initialization
 
     if (!config.dumb_terminal) {
-        char *home = getenv("HOME");
-        if (home != NULL) {
-            char history_name[] = ".planck_history";
-            size_t len = strlen(home) + strlen(history_name) + 2;
-            repl->history_path = malloc(len * sizeof(char));
-            snprintf(repl->history_path, len, "%s/%s", home, history_name);
-
-            linenoiseHistoryLoad(repl->history_path);
-
-            exit_value = load_keymap(home);
-            if (exit_value != EXIT_SUCCESS) {
-                return exit_value;
-            }
+        repl_load_line_editing();
+        repl->history_path = history_path;
+        if (keymap_result != EXIT_SUCCESS) {
+            exit_value = keymap_result;
+            return exit_value;
         }
 
         linenoiseSetMultiLine(1);
@@ -1,3 +1,7 @@
 extern JSContextRef global_ctx;
 
+// Loads the history and keymap used for line editing. Called by run_repl if
+// it hasn't already been done while the engine was initializing.
+void repl_load_line_editing();
+
 int run_repl(JSContextRef ctx);
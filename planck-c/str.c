@@ -33,3 +33,22 @@ char *str_concat(char *s1, char *s2) {
     strncpy(s + l1, s2, l2);
     return s;
 }
+
+// FNV-1a
+unsigned int str_hash(const char *s) {
+    unsigned int hash = 2166136261u;
+    while (*s) {
+        hash ^= (unsigned char) *s++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+unsigned long long str_hash64(const char *s) {
+    unsigned long long hash = 14695981039346656037ull;
+    while (*s) {
+        hash ^= (unsigned char) *s++;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
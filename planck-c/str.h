@@ -2,4 +2,8 @@ int str_has_suffix(char *str, char *suffix);
 
 int str_has_prefix(char *str, char *prefix);
 
-char *str_concat(char *s1, char *s2);
\ No newline at end of file
+char *str_concat(char *s1, char *s2);
+
+unsigned int str_hash(const char *s);
+
+unsigned long long str_hash64(const char *s);
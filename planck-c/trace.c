@@ -0,0 +1,104 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+// Events are buffered and written when the process exits, so that
+// tracing adds as little as possible to what is being measured.
+
+struct trace_event {
+    char phase;
+    const char *category;
+    char *name;
+    uint64_t timestamp;
+    unsigned long thread_id;
+};
+
+static char *trace_path = NULL;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_event *trace_events = NULL;
+static size_t trace_num_events = 0;
+static size_t trace_capacity = 0;
+
+static uint64_t trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+static void trace_add(char phase, const char *category, const char *name) {
+    if (trace_path == NULL) {
+        return;
+    }
+
+    uint64_t timestamp = trace_now();
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_num_events == trace_capacity) {
+        trace_capacity = trace_capacity == 0 ? 1024 : 2 * trace_capacity;
+        trace_events = realloc(trace_events, trace_capacity * sizeof(struct trace_event));
+    }
+    struct trace_event *event = &trace_events[trace_num_events++];
+    event->phase = phase;
+    event->category = category;
+    event->name = strdup(name);
+    event->timestamp = timestamp;
+    event->thread_id = (unsigned long) (uintptr_t) pthread_self();
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_begin(const char *category, const char *name) {
+    trace_add('B', category, name);
+}
+
+void trace_end(const char *category, const char *name) {
+    trace_add('E', category, name);
+}
+
+static void write_json_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', f);
+            fputc(*s, f);
+        } else if ((unsigned char) *s < 0x20) {
+            fprintf(f, "\\u%04x", (unsigned char) *s);
+        } else {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+static void trace_write() {
+    FILE *f = fopen(trace_path, "w");
+    if (f == NULL) {
+        perror(trace_path);
+        return;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (size_t i = 0; i < trace_num_events; i++) {
+        struct trace_event *event = &trace_events[i];
+        fprintf(f, "{\"ph\":\"%c\",\"cat\":", event->phase);
+        write_json_string(f, event->category);
+        fprintf(f, ",\"name\":");
+        write_json_string(f, event->name);
+        fprintf(f, ",\"ts\":%llu,\"pid\":1,\"tid\":%lu}%s\n", (unsigned long long) event->timestamp,
+                event->thread_id, i + 1 < trace_num_events ? "," : "");
+    }
+    fprintf(f, "],\"displayTimeUnit\":\"ms\"}\n");
+    pthread_mutex_unlock(&trace_lock);
+
+    fclose(f);
+}
+
+void trace_init(char *path) {
+    trace_path = path;
+    atexit(trace_write);
+}
@@ -0,0 +1,7 @@
+// Startup tracing, written out in Chrome trace event format
+
+void trace_init(char *path);
+
+void trace_begin(const char *category, const char *name);
+
+void trace_end(const char *category, const char *name);
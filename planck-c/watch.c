@@ -0,0 +1,306 @@
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "globals.h"
+#include "str.h"
+#include "watch.h"
+
+#ifdef __linux__
+
+// A thread reads inotify events for every directory under the src entries
+// of the classpath, collecting the paths of changed files, relative to the
+// classpath, into a set that the REPL drains before each evaluation. Whether
+// files have been added or removed is tracked separately, for the classpath
+// index, which would otherwise stat every directory to find out.
+//
+// Watching is only started for --auto-reload, and the directories are walked
+// (and watches added) on the thread, so that startup isn't held up by large
+// source trees.
+
+#define WATCH_MAX_DEPTH 64
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+struct watch_dir {
+    char *path;
+    char *prefix;
+};
+
+static int watch_fd = -1;
+
+// Indexed by watch descriptor, and only touched by the watch thread once
+// watching has started
+static struct watch_dir *watch_dirs = NULL;
+static int watch_num_dirs = 0;
+
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool watching = false;
+static bool dirs_changed = false;
+static char **changed_paths = NULL;
+static size_t num_changed_paths = 0;
+
+static void watch_note_change(char *path) {
+    pthread_mutex_lock(&watch_lock);
+    bool seen = false;
+    for (size_t i = 0; i < num_changed_paths; i++) {
+        if (strcmp(changed_paths[i], path) == 0) {
+            seen = true;
+            break;
+        }
+    }
+    if (!seen) {
+        changed_paths = realloc(changed_paths, (num_changed_paths + 1) * sizeof(char *));
+        changed_paths[num_changed_paths++] = strdup(path);
+    }
+    pthread_mutex_unlock(&watch_lock);
+}
+
+static void watch_note_dirs_changed() {
+    pthread_mutex_lock(&watch_lock);
+    dirs_changed = true;
+    pthread_mutex_unlock(&watch_lock);
+}
+
+// Watches dir (a full path ending in /) and the directories beneath it. If
+// report, the directory has just appeared (been created, or moved), and the
+// files found are noted as changed, as they may have been written before it
+// was watched. A directory moved within the source directories keeps its
+// watch descriptor, so its path (and those of the directories beneath it)
+// is then replaced.
+static void watch_add_dir(char *dir, char *prefix, int depth, bool report) {
+    if (depth > WATCH_MAX_DEPTH) {
+        return;
+    }
+
+    int wd = inotify_add_watch(watch_fd, dir, WATCH_EVENTS);
+    if (wd < 0) {
+        if (errno == ENOSPC && config.verbose) {
+            fprintf(stderr, "Unable to watch %s: inotify watch limit reached\n", dir);
+        }
+        return;
+    }
+
+    if (wd >= watch_num_dirs) {
+        int num_dirs = wd + 64;
+        watch_dirs = realloc(watch_dirs, num_dirs * sizeof(struct watch_dir));
+        memset(watch_dirs + watch_num_dirs, 0, (num_dirs - watch_num_dirs) * sizeof(struct watch_dir));
+        watch_num_dirs = num_dirs;
+    }
+    // The same directory may be reached twice, through overlapping classpath
+    // entries or symlinks; the first path to it wins, as it does for loading
+    if (watch_dirs[wd].path != NULL) {
+        if (!report) {
+            return;
+        }
+        free(watch_dirs[wd].path);
+        free(watch_dirs[wd].prefix);
+    }
+    watch_dirs[wd].path = strdup(dir);
+    watch_dirs[wd].prefix = strdup(prefix);
+
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+
+        char *full_path = str_concat(dir, ent->d_name);
+        char *rel_path = str_concat(prefix, ent->d_name);
+
+        struct stat st;
+        if (stat(full_path, &st) == 0) {
+            if (S_ISDIR(st.st_mode)) {
+                char *sub_dir = str_concat(full_path, "/");
+                char *sub_prefix = str_concat(rel_path, "/");
+                watch_add_dir(sub_dir, sub_prefix, depth + 1, report);
+                free(sub_dir);
+                free(sub_prefix);
+            } else if (report) {
+                watch_note_change(rel_path);
+            }
+        }
+
+        free(full_path);
+        free(rel_path);
+    }
+
+    closedir(d);
+}
+
+static void watch_handle_event(const struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        // Events were dropped, so there is no telling which files changed
+        if (config.verbose) {
+            fprintf(stderr, "Source directory watch overflowed; some changes may be missed\n");
+        }
+        watch_note_dirs_changed();
+        return;
+    }
+
+    if (event->wd < 0 || event->wd >= watch_num_dirs || watch_dirs[event->wd].path == NULL) {
+        return;
+    }
+    struct watch_dir *dir = &watch_dirs[event->wd];
+
+    if (event->mask & IN_IGNORED) {
+        // The directory was removed (or unmounted)
+        free(dir->path);
+        free(dir->prefix);
+        dir->path = NULL;
+        dir->prefix = NULL;
+        return;
+    }
+
+    if (event->len == 0) {
+        return;
+    }
+
+    if (event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+        watch_note_dirs_changed();
+    }
+
+    if (event->mask & IN_ISDIR) {
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            char *sub_dir = str_concat(dir->path, (char *) event->name);
+            char *sub_dir_slash = str_concat(sub_dir, "/");
+            char *sub_prefix = str_concat(dir->prefix, (char *) event->name);
+            char *sub_prefix_slash = str_concat(sub_prefix, "/");
+            watch_add_dir(sub_dir_slash, sub_prefix_slash, 0, true);
+            free(sub_dir);
+            free(sub_dir_slash);
+            free(sub_prefix);
+            free(sub_prefix_slash);
+        }
+    } else {
+        char *rel_path = str_concat(dir->prefix, (char *) event->name);
+        watch_note_change(rel_path);
+        free(rel_path);
+    }
+}
+
+static void *watch_thread(void *data) {
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    for (int i = 0; i < config.num_src_paths; i++) {
+        if (strcmp(config.src_paths[i].type, "src") == 0) {
+            watch_add_dir(config.src_paths[i].path, "", 0, false);
+        }
+    }
+
+    // Until now, the classpath index has been checking modification times.
+    // A change made before the watches were in place may have been seen by
+    // neither, so the index is rebuilt once.
+    pthread_mutex_lock(&watch_lock);
+    watching = true;
+    dirs_changed = true;
+    pthread_mutex_unlock(&watch_lock);
+
+    for (;;) {
+        ssize_t len = read(watch_fd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            break;
+        }
+
+        for (char *p = buf; p < buf + len;) {
+            const struct inotify_event *event = (const struct inotify_event *) p;
+            watch_handle_event(event);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    // Fall back to checking modification times
+    pthread_mutex_lock(&watch_lock);
+    watching = false;
+    dirs_changed = true;
+    pthread_mutex_unlock(&watch_lock);
+
+    return NULL;
+}
+
+bool watch_start(void) {
+    if (watch_fd >= 0) {
+        return true;
+    }
+
+    watch_fd = inotify_init1(IN_CLOEXEC);
+    if (watch_fd < 0) {
+        return false;
+    }
+
+    // The directories are walked on the watch thread, so as not to hold up
+    // startup
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, watch_thread, NULL) != 0) {
+        close(watch_fd);
+        watch_fd = -1;
+        return false;
+    }
+    pthread_detach(thread);
+
+    return true;
+}
+
+bool watch_active(void) {
+    pthread_mutex_lock(&watch_lock);
+    bool rv = watching;
+    pthread_mutex_unlock(&watch_lock);
+    return rv;
+}
+
+bool watch_dirs_changed(void) {
+    pthread_mutex_lock(&watch_lock);
+    bool rv = dirs_changed;
+    dirs_changed = false;
+    pthread_mutex_unlock(&watch_lock);
+    return rv;
+}
+
+char **watch_changes(size_t *count) {
+    pthread_mutex_lock(&watch_lock);
+    char **rv = changed_paths;
+    *count = num_changed_paths;
+    changed_paths = NULL;
+    num_changed_paths = 0;
+    pthread_mutex_unlock(&watch_lock);
+    return rv;
+}
+
+#else
+
+bool watch_start(void) {
+    return false;
+}
+
+bool watch_active(void) {
+    return false;
+}
+
+bool watch_dirs_changed(void) {
+    return false;
+}
+
+char **watch_changes(size_t *count) {
+    *count = 0;
+    return NULL;
+}
+
+#endif
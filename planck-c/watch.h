@@ -0,0 +1,22 @@
+// Watches the source directories on the classpath for changes, so that a
+// long-running REPL can notice edits without polling the file system
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Starts watching the src entries of config.src_paths, in the background.
+// Returns false if that isn't possible (it needs inotify, so is only
+// supported on Linux).
+bool watch_start(void);
+
+// Whether the source directories are being watched, in which case their
+// modification times needn't be checked for added or removed files
+bool watch_active(void);
+
+// Whether files have been added to or removed from the source directories
+// since the last call
+bool watch_dirs_changed(void);
+
+// Returns the paths (relative to the classpath) of the files changed since
+// the last call, setting count. The caller frees the paths and the array.
+char **watch_changes(size_t *count);